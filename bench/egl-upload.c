@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Uploads a framebuffer to the EGL texture with different damage patterns
+ * and reports the throughput of the damaged pixels. Exits with 77, which
+ * meson reports as skipped, if there is no render node or EGL.
+ */
+
+#include "renderer.h"
+#include "renderer-egl.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pixman.h>
+#include <gbm.h>
+#include <xf86drm.h>
+#include <drm_fourcc.h>
+#include <GLES2/gl2.h>
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ITERATIONS 200
+#define EXIT_SKIP 77
+
+extern struct gbm_device* gbm_device;
+
+struct damage_pattern {
+	const char* name;
+	void (*make)(struct pixman_region16* damage);
+};
+
+static void damage_full(struct pixman_region16* damage)
+{
+	pixman_region_union_rect(damage, damage, 0, 0, WIDTH, HEIGHT);
+}
+
+static void damage_box(struct pixman_region16* damage)
+{
+	pixman_region_union_rect(damage, damage, 832, 412, 256, 256);
+}
+
+// The bottom of the screen after scrolling a terminal
+static void damage_strip(struct pixman_region16* damage)
+{
+	pixman_region_union_rect(damage, damage, 0, HEIGHT - 64, WIDTH, 64);
+}
+
+static void damage_column(struct pixman_region16* damage)
+{
+	pixman_region_union_rect(damage, damage, WIDTH - 64, 0, 64, HEIGHT);
+}
+
+// Scattered glyph-sized boxes, as when typing into several windows
+static void damage_scattered(struct pixman_region16* damage)
+{
+	for (int i = 0; i < 256; ++i) {
+		int x = (i * 151) % (WIDTH - 16);
+		int y = (i * 97) % (HEIGHT - 16);
+		pixman_region_union_rect(damage, damage, x, y, 16, 16);
+	}
+}
+
+static const struct damage_pattern patterns[] = {
+	{ "full", damage_full },
+	{ "box-256", damage_box },
+	{ "strip", damage_strip },
+	{ "column", damage_column },
+	{ "scattered", damage_scattered },
+};
+
+static uint64_t region_area(struct pixman_region16* region)
+{
+	int n_boxes = 0;
+	struct pixman_box16* boxes = pixman_region_rectangles(region, &n_boxes);
+
+	uint64_t area = 0;
+	for (int i = 0; i < n_boxes; ++i)
+		area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+
+	return area;
+}
+
+static int open_render_node(void)
+{
+	drmDevice* devices[64];
+	int fd = -1;
+
+	int n = drmGetDevices2(0, devices, sizeof(devices) / sizeof(devices[0]));
+	for (int i = 0; i < n && fd < 0; ++i) {
+		drmDevice* dev = devices[i];
+		if (!(dev->available_nodes & (1 << DRM_NODE_RENDER)))
+			continue;
+
+		fd = open(dev->nodes[DRM_NODE_RENDER], O_RDWR | O_CLOEXEC);
+	}
+
+	drmFreeDevices(devices, n);
+	return fd;
+}
+
+static void run_pattern(struct image* image,
+		const struct damage_pattern* pattern)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+	pattern->make(&damage);
+
+	image->damage = &damage;
+
+	// The first upload after a resize is of the whole texture
+	import_image_egl(image, NULL, 0);
+	glFinish();
+
+	uint64_t start = gettime_us();
+
+	for (int i = 0; i < ITERATIONS; ++i)
+		import_image_egl(image, NULL, 0);
+	glFinish();
+
+	uint64_t time = gettime_us() - start;
+	double megabytes = region_area(&damage) * 4.0 * ITERATIONS / 1.0e6;
+
+	printf("%-10s %8.3f ms/upload %10.1f MB/s\n", pattern->name,
+			time / 1.0e3 / ITERATIONS,
+			time ? megabytes / (time / 1.0e6) : 0.0);
+
+	image->damage = NULL;
+	pixman_region_fini(&damage);
+}
+
+int main(void)
+{
+	int rc = EXIT_SKIP;
+
+	int fd = open_render_node();
+	if (fd < 0) {
+		fprintf(stderr, "No render node found\n");
+		return EXIT_SKIP;
+	}
+
+	gbm_device = gbm_create_device(fd);
+	if (!gbm_device) {
+		fprintf(stderr, "Failed to create GBM device\n");
+		goto gbm_failure;
+	}
+
+	if (egl_init(gbm_device) < 0) {
+		fprintf(stderr, "Failed to initialise EGL\n");
+		goto egl_failure;
+	}
+
+	struct image image = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.stride = WIDTH * 4,
+		.format = DRM_FORMAT_XRGB8888,
+		.pixels = malloc(WIDTH * HEIGHT * 4),
+	};
+	if (!image.pixels) {
+		rc = 1;
+		goto pixels_failure;
+	}
+
+	memset(image.pixels, 0x5a, WIDTH * HEIGHT * 4);
+
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i)
+		run_pattern(&image, &patterns[i]);
+
+	rc = 0;
+	free(image.pixels);
+pixels_failure:
+	egl_finish();
+egl_failure:
+	gbm_device_destroy(gbm_device);
+	gbm_device = NULL;
+gbm_failure:
+	close(fd);
+	return rc;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Times the FillRect and CopyRect handlers of the protocol library over a
+ * range of rectangle sizes, at 32 and 16 bits per pixel.
+ */
+
+#include "rfbclient.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define PIXELS_PER_RUN (UINT64_C(512) << 20)
+
+struct rect_op {
+	const char* name;
+	int src_x, src_y;
+	int x, y, width, height;
+};
+
+static const struct rect_op fills[] = {
+	{ "1x1", 0, 0, 100, 100, 1, 1 },
+	{ "16x16", 0, 0, 100, 100, 16, 16 },
+	{ "64x64", 0, 0, 100, 100, 64, 64 },
+	{ "256x256", 0, 0, 100, 100, 256, 256 },
+	{ "full", 0, 0, 0, 0, WIDTH, HEIGHT },
+};
+
+static const struct rect_op copies[] = {
+	{ "16x16", 0, 0, 500, 500, 16, 16 },
+	{ "64x64", 0, 0, 500, 500, 64, 64 },
+	{ "256x256-overlap", 100, 100, 132, 116, 256, 256 },
+	{ "scroll-up", 0, 16, 0, 0, WIDTH, HEIGHT - 16 },
+	{ "scroll-down", 0, 0, 0, 16, WIDTH, HEIGHT - 16 },
+	{ "move-right", 100, 100, 101, 100, 1024, 512 },
+};
+
+static void print_result(const char* kind, const struct rect_op* op,
+		uint64_t n, uint64_t time)
+{
+	uint64_t pixels = n * op->width * op->height;
+
+	printf("%-5s %-16s %9.1f ns/rect %9.1f Mpx/s\n", kind, op->name,
+			n ? time * 1.0e3 / n : 0.0,
+			time ? pixels / (double)time : 0.0);
+}
+
+static uint64_t get_iterations(const struct rect_op* op)
+{
+	uint64_t n = PIXELS_PER_RUN / ((uint64_t)op->width * op->height);
+	return n < 1000000 ? n : 1000000;
+}
+
+static void run_fill(rfbClient* client, const struct rect_op* op)
+{
+	uint64_t n = get_iterations(op);
+	uint64_t start = gettime_us();
+
+	for (uint64_t i = 0; i < n; ++i)
+		client->GotFillRect(client, op->x, op->y, op->width,
+				op->height, i);
+
+	print_result("fill", op, n, gettime_us() - start);
+}
+
+static void run_copy(rfbClient* client, const struct rect_op* op)
+{
+	uint64_t n = get_iterations(op);
+	uint64_t start = gettime_us();
+
+	for (uint64_t i = 0; i < n; ++i)
+		client->GotCopyRect(client, op->src_x, op->src_y, op->width,
+				op->height, op->x, op->y);
+
+	print_result("copy", op, n, gettime_us() - start);
+}
+
+int main(void)
+{
+	int rc = 1;
+
+	rfbClient* client = rfbGetClient(8, 3, 4);
+	if (!client)
+		return 1;
+
+	client->width = WIDTH;
+	client->height = HEIGHT;
+	client->frameBuffer = malloc(WIDTH * HEIGHT * 4);
+	if (!client->frameBuffer)
+		goto failure;
+
+	memset(client->frameBuffer, 0x5a, WIDTH * HEIGHT * 4);
+
+	static const int depths[] = { 32, 16 };
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+		client->format.bitsPerPixel = depths[d];
+		printf("%d bits per pixel:\n", depths[d]);
+
+		for (size_t i = 0; i < sizeof(fills) / sizeof(fills[0]); ++i)
+			run_fill(client, &fills[i]);
+
+		for (size_t i = 0; i < sizeof(copies) / sizeof(copies[0]); ++i)
+			run_copy(client, &copies[i]);
+	}
+
+	rc = 0;
+	free(client->frameBuffer);
+failure:
+	rfbClientCleanup(client);
+	return rc;
+}
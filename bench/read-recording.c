@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Feeds a session recorded with --record through the socket reader with a
+ * few read patterns that the decoders use, and reports how fast the data
+ * is handed over.
+ *
+ * Usage: read-recording <recording>
+ */
+
+#include "rfbclient.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIN_BYTES (UINT64_C(256) << 20)
+
+struct read_pattern {
+	const char* name;
+	// Use PeekFromRFBServer() and SkipFromRFBServer(), as inflate does
+	bool peek;
+	unsigned int sizes[4];
+	int n_sizes;
+};
+
+static const struct read_pattern patterns[] = {
+	{ "headers", false, { 1, 2, 4, 12 }, 4 },
+	{ "hextile", false, { 1, 16, 2, 64 }, 4 },
+	{ "peek-4k", true, { 4096 }, 1 },
+	{ "tiles-16k", false, { 12, 16384 }, 2 },
+	{ "bulk-1m", false, { 1 << 20 }, 1 },
+};
+
+static char buffer[1 << 20];
+
+/* Returns the number of bytes that were read, or -1 if the recording could
+ * not be opened.
+ */
+static int64_t read_once(const char* path, const struct read_pattern* pattern,
+		uint64_t* time)
+{
+	rfbClient* client = rfbGetClient(8, 3, 4);
+	if (!client)
+		return -1;
+
+	if (!StartReplayingRFBSession(client, path)) {
+		rfbClientCleanup(client);
+		return -1;
+	}
+
+	int64_t total = 0;
+	uint64_t start = gettime_us();
+
+	for (int i = 0;; i = (i + 1) % pattern->n_sizes) {
+		unsigned int size = pattern->sizes[i];
+
+		if (pattern->peek) {
+			const char* span;
+			if (!PeekFromRFBServer(client, &span, size))
+				break;
+			SkipFromRFBServer(client, size);
+		} else if (!ReadFromRFBServer(client, buffer, size)) {
+			break;
+		}
+
+		total += size;
+	}
+
+	*time += gettime_us() - start;
+	rfbClientCleanup(client);
+	return total;
+}
+
+static int run_pattern(const char* path, const struct read_pattern* pattern)
+{
+	uint64_t bytes = 0;
+	uint64_t time = 0;
+
+	while (bytes < MIN_BYTES) {
+		int64_t n = read_once(path, pattern, &time);
+		if (n <= 0)
+			return -1;
+
+		bytes += n;
+	}
+
+	printf("%-10s %10.1f MB/s\n", pattern->name,
+			time ? bytes / (double)time : 0.0);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <recording>\n", argv[0]);
+		return 1;
+	}
+
+	rfbEnableClientLogging = FALSE;
+	errorMessageOnReadFailure = FALSE;
+
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i) {
+		if (run_pattern(argv[1], &patterns[i]) < 0) {
+			fprintf(stderr, "Failed to read %s\n", argv[1]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Globals that the library expects main.c to define. Nothing here talks to
+ * a wayland display or a server.
+ */
+
+#include <stddef.h>
+
+struct wl_compositor* wl_compositor = NULL;
+struct wl_shm* wl_shm = NULL;
+struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf_v1 = NULL;
+struct gbm_device* gbm_device = NULL;
+
+const char* tls_cert_path = NULL;
+const char* auth_command = NULL;
+
+void run_main_loop_once(void)
+{
+}
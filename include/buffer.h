@@ -23,6 +23,7 @@
 
 struct wl_buffer;
 struct gbm_bo;
+struct fbo_info;
 
 enum buffer_type {
 	BUFFER_UNSPEC = 0,
@@ -41,12 +42,23 @@ struct buffer {
 	bool please_clean_up;
 	struct pixman_region16 damage;
 
+	/* The frame at which the contents were last brought up to date, or 0
+	 * if they never were.
+	 */
+	uint64_t seq;
+	uint64_t last_used; // us
+
+	// Called when the compositor is done with the buffer
+	void (*on_release)(struct buffer*);
+	void* userdata;
+
 	// wl_shm:
 	void* pixels;
 	int stride;
 
 	// dmabuf:
 	struct gbm_bo* bo;
+	struct fbo_info* fbo;
 };
 
 struct buffer* buffer_create_shm(int width, int height, int stride, uint32_t format);
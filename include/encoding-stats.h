@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+struct vnc_client;
+struct encoding_stats;
+
+/* Reports what each decoder has been up to. If period is non-zero, numbers
+ * for the last period are written to stderr every period seconds. If
+ * socket_path is set, numbers since the start of the session are written to
+ * anyone who connects to a unix socket at that path.
+ */
+struct encoding_stats* encoding_stats_create(struct vnc_client* vnc,
+		int period, const char* socket_path);
+void encoding_stats_destroy(struct encoding_stats* self);
+
+// Numbers since the start of the session
+void encoding_stats_print_totals(struct encoding_stats* self, FILE* stream);
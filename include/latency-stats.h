@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct wl_surface;
+struct wp_presentation;
+struct latency_stats;
+
+/* Measures the time from when the server captured a frame, according to
+ * the PTS that it sent along with it, until the compositor reports it as
+ * presented. Percentiles are written to stderr every period seconds.
+ *
+ * The PTS is taken to be in microseconds on the client's CLOCK_MONOTONIC,
+ * which holds when the server runs on the same machine. Otherwise, only the
+ * variation in latency is meaningful, and that is what is reported.
+ */
+struct latency_stats* latency_stats_create(
+		struct wp_presentation* presentation, int period);
+void latency_stats_destroy(struct latency_stats* self);
+
+// Call right before committing a surface that shows the frame with this PTS
+void latency_stats_track_commit(struct latency_stats* self,
+		struct wl_surface* surface, uint64_t pts);
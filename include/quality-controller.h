@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct quality_controller;
+
+// What happened during one framebuffer update
+struct quality_sample {
+	uint64_t bytes;
+	uint64_t pixels;
+	uint64_t decode_time; // us, not counting time spent waiting for data
+	uint64_t round_trip; // us, 0 if unknown
+};
+
+struct quality_settings {
+	int quality; // 0 - 9
+	bool prefer_h264;
+	int bits_per_pixel; // 32, 16 or 8
+};
+
+struct quality_controller_config {
+	bool adapt_quality;
+	bool can_use_h264;
+
+	/* Drop to fewer bits per pixel while the link is congested below this
+	 * throughput (bytes/s), or never if 0.
+	 */
+	uint64_t low_bandwidth_threshold;
+};
+
+/* Picks the JPEG quality level, whether to prefer open-h264 over tight and
+ * the number of bits per pixel, once per period, from the throughput, the
+ * decode time and the round trip time.
+ */
+struct quality_controller* quality_controller_create(
+		const struct quality_settings* initial,
+		const struct quality_controller_config* config);
+void quality_controller_destroy(struct quality_controller* self);
+
+/* Returns true if the settings have changed, in which case they are written
+ * to settings.
+ */
+bool quality_controller_add_sample(struct quality_controller* self,
+		const struct quality_sample* sample, uint64_t now,
+		struct quality_settings* settings);
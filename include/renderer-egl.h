@@ -1,14 +1,32 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 struct buffer;
 struct image;
 struct vnc_av_frame;
+struct vnc_render_op;
 struct gbm_device;
+struct fbo_info;
+struct pixman_region16;
 
 int egl_init(struct gbm_device* gbm);
 void egl_finish(void);
 
-void render_image_egl(struct buffer* dst, const struct image* src);
+void egl_fbo_destroy(struct fbo_info* fbo);
+
+bool egl_texture_is_renderable(uint32_t format);
+
+/* These return -1 if render ops other than uploads could not be applied,
+ * in which case the texture is missing their changes.
+ */
+int import_image_egl(const struct image* src,
+		const struct vnc_render_op* ops, int n_ops);
+void draw_image_egl(struct buffer* dst, const struct image* src);
+int render_image_egl(struct buffer* dst, const struct image* src,
+		const struct vnc_render_op* ops, int n_ops);
 void render_av_frames_egl(struct buffer* dst, struct vnc_av_frame** src,
 		int n_av_frames);
-
+void egl_copy_buffer(struct buffer* dst, struct buffer* src,
+		struct pixman_region16* region);
@@ -91,8 +91,53 @@ typedef struct {
   struct timeval tv;
   rfbBool readTimestamp;
   rfbBool doNotSleep;
+  /** TRUE if server data is being written to file, FALSE if it is replayed from it */
+  rfbBool recording;
+  /** Bytes left to replay from the current chunk */
+  uint32_t chunkLeft;
+  /** When the recording was started (us) */
+  uint64_t startTime;
 } rfbVNCRec;
 
+/** Kinds of rectangles that decoding statistics are kept for */
+
+typedef enum {
+  rfbStatsRaw = 0,
+  rfbStatsCopyRect,
+  rfbStatsRRE,
+  rfbStatsCoRRE,
+  rfbStatsHextile,
+  rfbStatsZlib,
+  rfbStatsTightBasic,
+  rfbStatsTightJpeg,
+  rfbStatsZRLE,
+  rfbStatsTRLE,
+  rfbStatsUltra,
+  rfbStatsOpenH264,
+  rfbStatsEncodingCount
+} rfbStatsEncoding;
+
+#define RFB_STATS_HISTOGRAM_SIZE 32
+
+/**
+ * Bucket 0 of a histogram counts zeros and bucket i counts values from
+ * 2^(i-1) up to 2^i. The last bucket also counts everything above that.
+ */
+typedef struct {
+  uint64_t rects;
+  /** Encoded bytes, not counting rectangle headers */
+  uint64_t bytes;
+  uint64_t pixels;
+  /** Time spent decoding, not counting time spent waiting for data (ns) */
+  uint64_t decodeTime;
+  /** Decode time per rectangle (ns) */
+  uint64_t decodeTimeHistogram[RFB_STATS_HISTOGRAM_SIZE];
+  /** Rectangles per update, for updates that had any */
+  uint64_t rectsPerUpdateHistogram[RFB_STATS_HISTOGRAM_SIZE];
+  /** Rectangles in the update that is being handled */
+  uint32_t updateRects;
+} rfbEncodingStats;
+
 /** client data */
 
 typedef struct rfbClientData {
@@ -120,6 +165,8 @@ typedef struct {
   rfbBool enableJPEG;
   rfbBool useRemoteCursor;
   rfbBool palmVNC;  /**< use palmvnc specific SetScale (vs ultravnc) */
+  rfbBool enableContinuousUpdates; /**< let the server stream updates without requests, if it can */
+  int updateRequestWindow; /**< number of update requests to keep outstanding */
   int scaleSetting; /**< 0 means no scale set, else 1/scaleSetting */
 } AppData;
 
@@ -205,6 +252,13 @@ typedef rfbCredential* (*GetCredentialProc)(struct _rfbClient* client, int crede
 typedef rfbBool (*MallocFrameBufferProc)(struct _rfbClient* client);
 typedef void (*GotXCutTextProc)(struct _rfbClient* client, const char *text, int textlen);
 typedef void (*BellProc)(struct _rfbClient* client);
+/**
+   Called from ReadFromRFBServer() when it needs more data than has been
+   received so far. It should return once the socket is readable. If not set,
+   the application's main loop is run once instead.
+   @param client The client which is waiting for data
+ */
+typedef void (*WaitForServerDataProc)(struct _rfbClient* client);
 /**
     Called when a cursor shape update was received from the server. The decoded cursor shape
     will be in client->rcSource. It's up to the application to do something with this, e.g. draw
@@ -225,6 +279,8 @@ typedef char* (*GetUserProc)(struct _rfbClient* client);
 typedef char* (*GetSASLMechanismProc)(struct _rfbClient* client, char* mechlist);
 #endif /* LIBVNCSERVER_HAVE_SASL */
 
+struct worker_pool;
+
 typedef struct _rfbClient {
 	uint8_t* frameBuffer;
 	int width, height;
@@ -261,8 +317,9 @@ typedef struct _rfbClient {
 	rfbServerInitMsg si;
 
 	/* sockets.c */
-#define RFB_BUF_SIZE 8192
+#define RFB_BUF_SIZE 65536
 	char buf[RFB_BUF_SIZE];
+	/** Read cursor into buf; unread data spans [bufoutptr, bufoutptr + buffered) */
 	char *bufoutptr;
 	unsigned int buffered;
 
@@ -442,6 +499,15 @@ typedef struct _rfbClient {
 	/** JPEG decoder state. */
 	void *tjhnd;
 
+	/** Per-worker JPEG decoder state, used with workerPool. */
+	void **workerTjhnds;
+	int workerTjhndsCount;
+
+	/** Tight JPEG rectangles waiting to be decoded on workerPool. */
+	struct _rfbPendingJpegRect *pendingJpegRects;
+	int pendingJpegRectsCount;
+	int pendingJpegRectsSize;
+
 #endif
 #endif
 	/* timeout in seconds for select() after connect() */
@@ -465,6 +531,55 @@ typedef struct _rfbClient {
 
 	StartingFrameBufferUpdateProc StartingFrameBufferUpdate;
 	CancelledFrameBufferUpdateProc CancelledFrameBufferUpdate;
+
+	WaitForServerDataProc WaitForServerData;
+
+	/**
+	 * Mutex to keep messages written from different threads from being
+	 * interleaved. For internal use only.
+	 */
+	MUTEX(writeMutex);
+
+	/**
+	 * Optional pool of threads for decoders that can split a rectangle
+	 * into independent pieces. Owned by the application.
+	 */
+	struct worker_pool* workerPool;
+
+	/** The server has announced the ContinuousUpdates extension. */
+	rfbBool continuousUpdatesSupported;
+	/** The server is sending updates without waiting for requests. */
+	rfbBool continuousUpdatesEnabled;
+	/** The server has sent a fence, so the client may send them too. */
+	rfbBool fenceSupported;
+	/** When the fence that measures the round trip was sent (us), or 0. */
+	uint64_t fenceSentTime;
+	/** The last round trip time measured with a fence, in microseconds. */
+	uint64_t fenceRoundTrip;
+
+	/** Update requests that the server has not answered yet. */
+	int pendingUpdateRequests;
+	/** Totals since the connection was made. */
+	uint64_t updateRequestsSent;
+	uint64_t updatesReceived;
+
+	/** Bytes read from the server since the connection was made. */
+	uint64_t bytesReceived;
+	/** Time spent blocked waiting for data from the server (us). */
+	uint64_t waitTime;
+
+	/** Pixel format changes whose fences have not been answered yet. */
+	int pixelFormatChangesInFlight;
+	/** The format that the server will be using once they have been. */
+	rfbPixelFormat requestedFormat;
+
+	/** Decoding statistics since the connection was made. These are
+	 * updated by the thread that handles server messages. */
+	rfbEncodingStats encodingStats[rfbStatsEncodingCount];
+	/** Set by the Tight decoder when it has read a JPEG rectangle. */
+	rfbBool tightRectIsJpeg;
+	/** Time spent decoding batched JPEG rectangles (ns). */
+	uint64_t jpegBatchTime;
 } rfbClient;
 
 /* cursor.c */
@@ -532,6 +647,39 @@ extern rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client);
 extern rfbBool SendFramebufferUpdateRequest(rfbClient* client,
 					 int x, int y, int w, int h,
 					 rfbBool incremental);
+/**
+ * Asks the server to start or stop sending updates for the given rectangle
+ * without waiting for update requests. Only valid once the server has
+ * announced support, see rfbClient.continuousUpdatesSupported.
+ * @param client The client through which to send the message
+ * @param enable true to start continuous updates, false to stop them
+ * @return true if the message was sent successfully, false otherwise
+ */
+extern rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable,
+					   int x, int y, int w, int h);
+/**
+ * Sends a fence to the server. Only valid once the server has sent a fence,
+ * see rfbClient.fenceSupported.
+ * @param client The client through which to send the fence
+ * @param flags Combination of the rfbFenceFlag* values
+ * @param length Length of the data, up to rfbFenceMaxDataLength bytes
+ * @param data Data that the server sends back in its response
+ * @return true if the fence was sent successfully, false otherwise
+ */
+extern rfbBool SendFence(rfbClient* client, uint32_t flags,
+			 unsigned int length, const char* data);
+/**
+ * Switches to another pixel format while connected. The new format is sent
+ * together with a fence, and client->format is only changed, and the frame
+ * buffer reallocated, when the answer to the fence arrives. Updates that were
+ * already on their way are still decoded in the old format. Only valid once
+ * the server has sent a fence, see rfbClient.fenceSupported.
+ * @param client The client through which to send the pixel format
+ * @param format The new pixel format
+ * @return true if the pixel format was sent successfully, false otherwise
+ */
+extern rfbBool SendPixelFormatChange(rfbClient* client,
+				     const rfbPixelFormat* format);
 extern rfbBool SendScaleSetting(rfbClient* client,int scaleSetting);
 /**
  * Sends a pointer event to the server. A pointer event includes a cursor
@@ -634,6 +782,8 @@ extern rfbBool PermitServerInput(rfbClient* client, int enabled);
 extern rfbBool SendXvpMsg(rfbClient* client, uint8_t version, uint8_t code);
 
 extern void PrintPixelFormat(rfbPixelFormat *format);
+/** Frees the Tight JPEG rectangles that were still waiting to be decoded. */
+extern void FreePendingJpegRects(rfbClient* client);
 
 extern rfbBool SupportsClient2Server(rfbClient* client, int messageType);
 extern rfbBool SupportsServer2Client(rfbClient* client, int messageType);
@@ -687,7 +837,33 @@ void rfbClientRegisterExtension(rfbClientProtocolExtension* e);
 extern rfbBool errorMessageOnReadFailure;
 
 extern rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n);
+/**
+ * Makes at least n bytes (n <= RFB_BUF_SIZE) available contiguously in the
+ * receive buffer without consuming them. On success, *span points at the
+ * unread data, which stays valid until the next read from the server. Up to
+ * client->buffered bytes may be inspected.
+ */
+extern rfbBool PeekFromRFBServer(rfbClient* client, const char** span, unsigned int n);
+/** Consumes n bytes previously made available by PeekFromRFBServer() */
+extern void SkipFromRFBServer(rfbClient* client, unsigned int n);
 extern rfbBool WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n);
+/**
+ * Starts writing everything that is received from the server to a file,
+ * preceded by the connection parameters that were negotiated during
+ * initialisation. Call this after InitialiseRFBConnection().
+ * @return true if the file was created, false otherwise
+ */
+extern rfbBool StartRecordingRFBSession(rfbClient* client, const char* path);
+/**
+ * Feeds a session recorded by StartRecordingRFBSession() to the client
+ * instead of reading from the network. Messages to the server are discarded.
+ * This replaces InitialiseRFBConnection(): the protocol version, server init
+ * message, desktop name and pixel format are restored from the recording.
+ * @return true if the recording was opened, false otherwise
+ */
+extern rfbBool StartReplayingRFBSession(rfbClient* client, const char* path);
+/** Returns true once a replayed session has been read to the end */
+extern rfbBool IsRFBSessionReplayDone(rfbClient* client);
 /**
    Tries to connect to an IPv4 host.
    @param host Binary IPv4 address
@@ -369,6 +369,8 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* ContinuousUpdates extension */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -396,6 +398,10 @@ typedef struct {
 #define rfbXvp 250
 /* SetDesktopSize client -> server message */
 #define rfbSetDesktopSize 251
+/* ContinuousUpdates extension */
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 #define rfbQemuEvent 255
 
 
@@ -420,6 +426,7 @@ typedef struct {
 #define rfbEncodingTRLE 15
 #define rfbEncodingZRLE 16
 #define rfbEncodingZYWRLE 17
+#define rfbEncodingOpenH264 50
 
 #define rfbEncodingH264               0x48323634
 
@@ -438,6 +445,10 @@ typedef struct {
 /* Xvp pseudo-encoding */
 #define rfbEncodingXvp 			 0xFFFFFECB
 
+/* Pipelining pseudo-encodings */
+#define rfbEncodingFence             0xFFFFFEC8 /* -312 */
+#define rfbEncodingContinuousUpdates 0xFFFFFEC7 /* -313 */
+
 /*
  * Special encoding numbers:
  *   0xFFFFFD00 .. 0xFFFFFD05 -- subsampling level
@@ -1106,6 +1117,33 @@ typedef struct {
 
 #define sz_rfbXvpMsg (4)
 
+/*-----------------------------------------------------------------------------
+ * Fence - bidirectional synchronisation point.
+ *
+ * Either side may send a fence with the Request flag set, which the other
+ * side answers with the same data and with the flags that it supports, once
+ * the requirements of those flags are met. A client may only send fences
+ * after the server has sent one, which it does when the client announces
+ * the Fence pseudo-encoding.
+ */
+
+#define rfbFenceFlagBlockBefore (1 << 0)
+#define rfbFenceFlagBlockAfter (1 << 1)
+#define rfbFenceFlagSyncNext (1 << 2)
+#define rfbFenceFlagRequest (1U << 31)
+
+#define rfbFenceMaxDataLength 64
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;
+    /* followed by char data[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg (9)
+
 /* server message codes */
 #define rfbXvp_Fail 0
 #define rfbXvp_Init 1
@@ -1228,6 +1266,7 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbFenceMsg fence;
 } rfbServerToClientMsg;
 
 
@@ -1324,6 +1363,26 @@ typedef struct {
 #define sz_rfbFramebufferUpdateRequestMsg 10
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - ask the server to send updates for the given
+ * rectangle without waiting for FramebufferUpdateRequests, or to stop doing
+ * so. The server announces support by sending EndOfContinuousUpdates when
+ * the client announces the ContinuousUpdates pseudo-encoding, and sends it
+ * again whenever it stops sending continuous updates.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
 /*-----------------------------------------------------------------------------
  * KeyEvent - key press or release
  *
@@ -1506,6 +1565,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbSetDesktopSizeMsg sdm;
+	rfbEnableContinuousUpdatesMsg ecu;
+	rfbFenceMsg fence;
 } rfbClientToServerMsg;
 
 /* 
@@ -473,6 +473,59 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle,
   int width, int pitch, int height, int pixelFormat, int flags);
 
 
+/**
+ * The width of a plane in a YUV image that was decompressed with
+ * #tjDecompressToYUVPlanes().  This is padded to the MCU boundary.
+ *
+ * @param componentID ID number of the image plane (0 = Y, 1 = U/Cb, 2 = V/Cr)
+ * @param width width (in pixels) of the JPEG image
+ * @param subsamp level of chrominance subsampling in the image (see @ref
+ *        TJSAMP "Chrominance subsampling options".)
+ *
+ * @return the plane width, or -1 if the arguments are out of bounds.
+ */
+DLLEXPORT int DLLCALL tjPlaneWidth(int componentID, int width, int subsamp);
+
+
+/**
+ * The height of a plane in a YUV image that was decompressed with
+ * #tjDecompressToYUVPlanes().  This is padded to the MCU boundary.
+ *
+ * @param componentID ID number of the image plane (0 = Y, 1 = U/Cb, 2 = V/Cr)
+ * @param height height (in pixels) of the JPEG image
+ * @param subsamp level of chrominance subsampling in the image (see @ref
+ *        TJSAMP "Chrominance subsampling options".)
+ *
+ * @return the plane height, or -1 if the arguments are out of bounds.
+ */
+DLLEXPORT int DLLCALL tjPlaneHeight(int componentID, int height, int subsamp);
+
+
+/**
+ * Decompress a JPEG image into separate Y, U (Cb), and V (Cr) image planes
+ * without colour conversion or chrominance upsampling.  The JPEG image must
+ * be YCbCr-encoded with one of the 4:4:4, 4:2:2, 4:2:0 or 4:4:0 subsampling
+ * levels, and it is not scaled.
+ *
+ * @param handle a handle to a TurboJPEG decompressor or transformer instance
+ * @param jpegBuf pointer to a buffer containing the JPEG image to decompress
+ * @param jpegSize size of the JPEG image (in bytes)
+ * @param dstPlanes an array of three pointers to Y, U (Cb), and V (Cr) image
+ *        planes.  Each plane must be at least <tt>strides[i] *
+ *        #tjPlaneHeight()</tt> bytes in size.
+ * @param strides an array of three integers specifying the number of bytes
+ *        per line in each plane.  Each stride must be at least
+ *        #tjPlaneWidth().
+ * @param flags the bitwise OR of one or more of the @ref TJFLAG_BOTTOMUP
+ *        "flags".  #TJFLAG_BOTTOMUP and #TJFLAG_FASTUPSAMPLE have no effect.
+ *
+ * @return 0 if successful, or -1 if an error occurred (see #tjGetErrorStr().)
+ */
+DLLEXPORT int DLLCALL tjDecompressToYUVPlanes(tjhandle handle,
+  unsigned char *jpegBuf, unsigned long jpegSize, unsigned char **dstPlanes,
+  int *strides, int flags);
+
+
 /**
  * Destroy a TurboJPEG compressor, decompressor, or transformer instance.
  *
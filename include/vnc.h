@@ -19,6 +19,7 @@
 #include "rfbclient.h"
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <pixman.h>
 #include <wayland-client.h>
@@ -27,12 +28,48 @@
 
 struct open_h264;
 struct AVFrame;
+struct vnc_thread;
+struct quality_controller;
 
 struct vnc_av_frame {
 	struct AVFrame* frame;
 	int x, y, width, height;
 };
 
+enum vnc_render_op_type {
+	VNC_RENDER_OP_UPLOAD,
+	VNC_RENDER_OP_YUV,
+	VNC_RENDER_OP_COPY,
+};
+
+/* A JPEG rectangle that is decoded into Y, Cb and Cr planes. The planes are
+ * NULL if decoding failed.
+ */
+struct vnc_yuv_frame {
+	uint8_t* jpeg;
+	int jpeg_len;
+	int subsamp;
+
+	uint8_t* planes[3];
+	int strides[3];
+	int chroma_width, chroma_height;
+};
+
+/* Changes to the framebuffer in the order that they were received:
+ *  - UPLOAD: the rectangle was decoded into the framebuffer.
+ *  - YUV: the rectangle is to be drawn from yuv.
+ *  - COPY: the rectangle is to be copied from src_x, src_y.
+ */
+struct vnc_render_op {
+	enum vnc_render_op_type type;
+	int x, y, width, height;
+	int src_x, src_y;
+	struct vnc_yuv_frame yuv;
+};
+
+// The server did not say when the frame was captured
+#define NO_PTS UINT64_MAX
+
 struct vnc_client {
 	rfbClient* client;
 
@@ -51,6 +88,63 @@ struct vnc_client {
 
 	bool handler_lock;
 	bool is_updating;
+
+	/* Run the protocol and decoders on a separate thread. Callbacks are
+	 * still invoked on the main thread via vnc_client_dispatch().
+	 */
+	bool use_thread;
+	struct vnc_thread* thread;
+
+	/* Decode Tight JPEG rectangles into YUV planes for the renderer
+	 * instead of into the framebuffer. Those rectangles never reach the
+	 * framebuffer, so every change to it is recorded in render_ops and
+	 * must be replayed in order.
+	 */
+	bool decode_jpeg_to_yuv;
+
+	/* Copy rectangles on the texture instead of in the framebuffer. The
+	 * copies are also recorded in render_ops. stale_fb is where the
+	 * framebuffer has fallen behind the texture because of that.
+	 */
+	bool gpu_copy_rect;
+	atomic_bool gpu_copy_rect_failed;
+	struct pixman_region16 stale_fb;
+	struct pixman_region16 update_uploads;
+
+	bool current_rect_is_render_op;
+	struct vnc_render_op* render_ops;
+	int n_render_ops;
+	int render_ops_size;
+	GotCopyRectProc copy_rect;
+	void** tj_handles;
+	int n_tj_handles;
+
+	/* Adjust the JPEG quality level and the choice between open-h264 and
+	 * tight while connected, based on what each update costs.
+	 */
+	bool adaptive_quality;
+	struct quality_controller* quality_controller;
+	// ZRLE overwrites appData.qualityLevel, so this is what was sent
+	int quality_level;
+	char* adaptive_encodings;
+	bool prefer_h264;
+	uint64_t update_start;
+	uint64_t update_wait_start;
+	uint64_t update_pixels;
+	uint64_t last_bytes_received;
+
+	/* Switch to 16 or 8 bits per pixel while the link is congested below
+	 * this throughput (bytes/s). The frame buffer is in fb_pixel_format,
+	 * which is pixel_format except while the depth is reduced.
+	 */
+	uint64_t low_bandwidth_threshold;
+	uint32_t pixel_format;
+	uint32_t fb_pixel_format;
+
+	/* Write everything received from the server to record_path once the
+	 * connection is initialised.
+	 */
+	const char* record_path;
 };
 
 struct vnc_client* vnc_client_create(void);
@@ -58,8 +152,13 @@ void vnc_client_destroy(struct vnc_client* self);
 
 int vnc_client_connect(struct vnc_client* self, const char* address, int port);
 int vnc_client_init(struct vnc_client* self);
+int vnc_client_open_replay(struct vnc_client* self, const char* path);
+bool vnc_client_is_replay_done(const struct vnc_client* self);
 
 int vnc_client_set_pixel_format(struct vnc_client* self, uint32_t format);
+uint32_t vnc_client_get_pixel_format(const struct vnc_client* self);
+void vnc_client_disable_gpu_copy_rect(struct vnc_client* self);
+void vnc_client_request_refresh(struct vnc_client* self);
 
 int vnc_client_get_fd(const struct vnc_client* self);
 int vnc_client_get_width(const struct vnc_client* self);
@@ -69,6 +168,11 @@ void* vnc_client_get_fb(const struct vnc_client* self);
 void vnc_client_set_fb(struct vnc_client* self, void* fb);
 const char* vnc_client_get_desktop_name(const struct vnc_client* self);
 int vnc_client_process(struct vnc_client* self);
+int vnc_client_get_event_fd(const struct vnc_client* self);
+int vnc_client_dispatch(struct vnc_client* self);
+void vnc_client_stop_thread(struct vnc_client* self);
+void vnc_client_get_encoding_stats(struct vnc_client* self,
+		rfbEncodingStats* stats);
 void vnc_client_send_pointer_event(struct vnc_client* self, int x, int y,
 		uint32_t button_mask);
 void vnc_client_send_keyboard_event(struct vnc_client* self, uint32_t symbol,
@@ -76,5 +180,11 @@ void vnc_client_send_keyboard_event(struct vnc_client* self, uint32_t symbol,
 void vnc_client_set_encodings(struct vnc_client* self, const char* encodings);
 void vnc_client_set_quality_level(struct vnc_client* self, int value);
 void vnc_client_set_compression_level(struct vnc_client* self, int value);
+void vnc_client_set_continuous_updates(struct vnc_client* self, bool enable);
+void vnc_client_set_update_request_window(struct vnc_client* self, int value);
+int vnc_client_set_decode_workers(struct vnc_client* self, int value);
+void vnc_client_set_adaptive_quality(struct vnc_client* self, bool enable);
+void vnc_client_set_low_bandwidth_threshold(struct vnc_client* self,
+		uint64_t bytes_per_second);
 void vnc_client_send_cut_text(struct vnc_client* self, const char* text,
 		size_t len);
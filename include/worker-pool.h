@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+struct worker_pool;
+
+/* Called once per job. worker is 0 for the thread that called
+ * worker_pool_run() and 1 ... n - 1 for the pool's own threads, so it can be
+ * used to index per-worker state.
+ */
+typedef void (*worker_pool_fn)(void* userdata, int job, int worker);
+
+struct worker_pool* worker_pool_create(int n_workers);
+void worker_pool_destroy(struct worker_pool* self);
+
+int worker_pool_get_n_workers(const struct worker_pool* self);
+
+/* Runs jobs 0 ... n_jobs - 1 and returns when all of them have completed.
+ * The calling thread takes part in the work.
+ */
+void worker_pool_run(struct worker_pool* self, worker_pool_fn fn,
+		void* userdata, int n_jobs);
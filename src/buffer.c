@@ -15,9 +15,11 @@
  */
 
 #include "buffer.h"
+#include "renderer-egl.h"
 #include "shm.h"
 #include "pixels.h"
 #include "linux-dmabuf-v1.h"
+#include "usdt.h"
 
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -36,9 +38,15 @@ static void buffer_release(void* data, struct wl_buffer* wl_buffer)
 	struct buffer* self = data;
 	self->is_attached = false;
 
+	DTRACE_PROBE2(wlvncc, buffer_release, self, self->seq);
+
 	if (self->please_clean_up) {
 		buffer_destroy(self);
+		return;
 	}
+
+	if (self->on_release)
+		self->on_release(self);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -170,6 +178,7 @@ void buffer_destroy(struct buffer* self)
 		munmap(self->pixels, self->size);
 		break;
 	case BUFFER_DMABUF:
+		egl_fbo_destroy(self->fbo);
 		gbm_bo_destroy(self->bo);
 		break;
 	default:
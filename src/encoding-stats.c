@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "encoding-stats.h"
+#include "vnc.h"
+#include "time-util.h"
+#include "strlcpy.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <aml.h>
+
+struct encoding_stats {
+	struct vnc_client* vnc;
+
+	struct aml_ticker* ticker;
+	rfbEncodingStats last[rfbStatsEncodingCount];
+	uint64_t last_time;
+
+	struct aml_handler* listener;
+	char* socket_path;
+	uint64_t start_time;
+};
+
+static const char* encoding_names[rfbStatsEncodingCount] = {
+	[rfbStatsRaw] = "raw",
+	[rfbStatsCopyRect] = "copyrect",
+	[rfbStatsRRE] = "rre",
+	[rfbStatsCoRRE] = "corre",
+	[rfbStatsHextile] = "hextile",
+	[rfbStatsZlib] = "zlib",
+	[rfbStatsTightBasic] = "tight",
+	[rfbStatsTightJpeg] = "tight-jpeg",
+	[rfbStatsZRLE] = "zrle",
+	[rfbStatsTRLE] = "trle",
+	[rfbStatsUltra] = "ultra",
+	[rfbStatsOpenH264] = "open-h264",
+};
+
+// Upper bound of the histogram bucket that holds the given percentile
+static uint64_t histogram_percentile(const uint64_t* histogram, double p)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < RFB_STATS_HISTOGRAM_SIZE; ++i)
+		total += histogram[i];
+
+	if (total == 0)
+		return 0;
+
+	uint64_t target = (uint64_t)(total * p);
+	uint64_t sum = 0;
+	for (int i = 0; i < RFB_STATS_HISTOGRAM_SIZE; ++i) {
+		sum += histogram[i];
+		if (sum > target)
+			return i == 0 ? 0 : UINT64_C(1) << i;
+	}
+
+	return UINT64_C(1) << (RFB_STATS_HISTOGRAM_SIZE - 1);
+}
+
+static void encoding_stats_diff(rfbEncodingStats* dst,
+		const rfbEncodingStats* now, const rfbEncodingStats* before)
+{
+	dst->rects = now->rects - before->rects;
+	dst->bytes = now->bytes - before->bytes;
+	dst->pixels = now->pixels - before->pixels;
+	dst->decodeTime = now->decodeTime - before->decodeTime;
+
+	for (int i = 0; i < RFB_STATS_HISTOGRAM_SIZE; ++i) {
+		dst->decodeTimeHistogram[i] = now->decodeTimeHistogram[i] -
+			before->decodeTimeHistogram[i];
+		dst->rectsPerUpdateHistogram[i] =
+			now->rectsPerUpdateHistogram[i] -
+			before->rectsPerUpdateHistogram[i];
+	}
+}
+
+static void encoding_stats_print(FILE* stream,
+		const rfbEncodingStats* stats, double elapsed)
+{
+	fprintf(stream, "%-11s %8s %7s %9s %9s %8s %8s %8s %8s %7s\n",
+			"encoding", "rects", "rects/u", "MB/s", "Mpx/s",
+			"cpu %", "us/rect", "p50 us", "p99 us", "ns/px");
+
+	for (int i = 0; i < rfbStatsEncodingCount; ++i) {
+		const rfbEncodingStats* s = &stats[i];
+		if (s->rects == 0)
+			continue;
+
+		uint64_t updates = 0;
+		for (int j = 0; j < RFB_STATS_HISTOGRAM_SIZE; ++j)
+			updates += s->rectsPerUpdateHistogram[j];
+
+		fprintf(stream, "%-11s %8" PRIu64 " %7.1f %9.3f %9.2f %8.1f %8.1f %8.1f %8.1f %7.2f\n",
+				encoding_names[i], s->rects,
+				updates ? (double)s->rects / updates : 0.0,
+				s->bytes / elapsed / 1.0e6,
+				s->pixels / elapsed / 1.0e6,
+				s->decodeTime / elapsed / 1.0e7,
+				s->decodeTime / 1.0e3 / s->rects,
+				histogram_percentile(s->decodeTimeHistogram,
+					0.5) / 1.0e3,
+				histogram_percentile(s->decodeTimeHistogram,
+					0.99) / 1.0e3,
+				s->pixels ? (double)s->decodeTime / s->pixels :
+					0.0);
+	}
+}
+
+static void encoding_stats_on_tick(struct aml_ticker* ticker)
+{
+	struct encoding_stats* self = aml_get_userdata(ticker);
+	rfbEncodingStats now[rfbStatsEncodingCount];
+	rfbEncodingStats period[rfbStatsEncodingCount];
+
+	vnc_client_get_encoding_stats(self->vnc, now);
+
+	uint64_t time = gettime_us();
+	double elapsed = (time - self->last_time) / 1.0e6;
+
+	for (int i = 0; i < rfbStatsEncodingCount; ++i)
+		encoding_stats_diff(&period[i], &now[i], &self->last[i]);
+
+	encoding_stats_print(stderr, period, elapsed);
+
+	memcpy(self->last, now, sizeof(self->last));
+	self->last_time = time;
+}
+
+void encoding_stats_print_totals(struct encoding_stats* self, FILE* stream)
+{
+	rfbEncodingStats total[rfbStatsEncodingCount];
+	vnc_client_get_encoding_stats(self->vnc, total);
+
+	double elapsed = (gettime_us() - self->start_time) / 1.0e6;
+	encoding_stats_print(stream, total, elapsed);
+}
+
+static void encoding_stats_on_connection(struct aml_handler* handler)
+{
+	struct encoding_stats* self = aml_get_userdata(handler);
+
+	int fd = accept4(aml_get_fd(handler), NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	FILE* stream = fdopen(fd, "w");
+	if (!stream) {
+		close(fd);
+		return;
+	}
+
+	encoding_stats_print_totals(self, stream);
+	fclose(stream);
+}
+
+static int encoding_stats_listen(struct encoding_stats* self,
+		const char* path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Stats socket path is too long: %s\n", path);
+		return -1;
+	}
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Failed to bind stats socket %s: %m\n", path);
+		goto failure;
+	}
+
+	if (listen(fd, 4) < 0)
+		goto failure;
+
+	self->socket_path = strdup(path);
+	if (!self->socket_path)
+		goto failure;
+
+	self->listener = aml_handler_new(fd, encoding_stats_on_connection,
+			self, NULL);
+	if (!self->listener)
+		goto failure;
+
+	if (aml_start(aml_get_default(), self->listener) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	if (self->listener) {
+		aml_unref(self->listener);
+		self->listener = NULL;
+	}
+	if (self->socket_path) {
+		unlink(self->socket_path);
+		free(self->socket_path);
+		self->socket_path = NULL;
+	}
+	close(fd);
+	return -1;
+}
+
+struct encoding_stats* encoding_stats_create(struct vnc_client* vnc,
+		int period, const char* socket_path)
+{
+	struct encoding_stats* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->vnc = vnc;
+	self->start_time = gettime_us();
+	self->last_time = self->start_time;
+
+	if (period > 0) {
+		self->ticker = aml_ticker_new(period * UINT64_C(1000000),
+				encoding_stats_on_tick, self, NULL);
+		if (!self->ticker)
+			goto failure;
+
+		if (aml_start(aml_get_default(), self->ticker) < 0)
+			goto failure;
+	}
+
+	if (socket_path && encoding_stats_listen(self, socket_path) < 0)
+		goto failure;
+
+	return self;
+
+failure:
+	encoding_stats_destroy(self);
+	return NULL;
+}
+
+void encoding_stats_destroy(struct encoding_stats* self)
+{
+	if (!self)
+		return;
+
+	if (self->listener) {
+		aml_stop(aml_get_default(), self->listener);
+		close(aml_get_fd(self->listener));
+		aml_unref(self->listener);
+	}
+
+	if (self->socket_path) {
+		unlink(self->socket_path);
+		free(self->socket_path);
+	}
+
+	if (self->ticker) {
+		aml_stop(aml_get_default(), self->ticker);
+		aml_unref(self->ticker);
+	}
+
+	free(self);
+}
@@ -132,6 +132,13 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
      readUncompressed = TRUE;
   }
 
+  client->tightRectIsJpeg = comp_ctl == rfbTightJpeg;
+
+  /* Everything but JPEG is decoded in place right away and may overlap
+     pending JPEG rectangles. */
+  if (comp_ctl != rfbTightJpeg && !FlushPendingJpegRects(client))
+    return FALSE;
+
   /* Handle solid rectangles. */
   if (comp_ctl == rfbTightFill) {
 #if BPP == 32
@@ -580,15 +587,10 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     return FALSE;
   }
 
-  if(client->GotJpeg != NULL)
-    return client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
-  
-  if (!client->tjhnd) {
-    if ((client->tjhnd = tjInitDecompress()) == NULL) {
-      rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
-      free(compressedData);
-      return FALSE;
-    }
+  if(client->GotJpeg != NULL) {
+    rfbBool ok = client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
+    free(compressedData);
+    return ok;
   }
 
 #if BPP == 16
@@ -606,6 +608,20 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
   dst = &client->frameBuffer[y * pitch + x * pixelSize];
 #endif
 
+#if BPP == 32
+  if (client->workerPool)
+    return QueueJpegRect(client, compressedData, compressedLen, x, y, w, h,
+                         flags);
+#endif
+
+  if (!client->tjhnd) {
+    if ((client->tjhnd = tjInitDecompress()) == NULL) {
+      rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+      free(compressedData);
+      return FALSE;
+    }
+  }
+
   if (tjDecompress(client->tjhnd, compressedData, (unsigned long)compressedLen,
                    dst, w, pitch, h, pixelSize, flags)==-1) {
     rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
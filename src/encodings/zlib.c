@@ -96,18 +96,17 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   while (( remaining > 0 ) &&
          ( inflateResult == Z_OK )) {
   
-    if ( remaining > RFB_BUFFER_SIZE ) {
-      toRead = RFB_BUFFER_SIZE;
-    }
-    else {
-      toRead = remaining;
-    }
+    const char* span;
 
-    /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(client, client->buffer,toRead))
+    /* Inflate straight out of the socket buffer, using whatever is
+     * already there and waiting for at least one byte. */
+    if (!PeekFromRFBServer(client, &span, 1))
       return FALSE;
 
-    client->decompStream.next_in  = ( Bytef * )client->buffer;
+    toRead = (unsigned int)remaining < client->buffered ?
+      remaining : (int)client->buffered;
+
+    client->decompStream.next_in  = ( Bytef * )span;
     client->decompStream.avail_in = toRead;
 
     /* Need to uncompress buffer full. */
@@ -135,6 +134,7 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       return FALSE;
     }
 
+    SkipFromRFBServer(client, toRead);
     remaining -= toRead;
 
   } /* while ( remaining > 0 ) */
@@ -35,12 +35,21 @@
 #if !defined(UNCOMP) || UNCOMP==0
 #define HandleZRLE CONCAT2E(HandleZRLE,REALBPP)
 #define HandleZRLETile CONCAT2E(HandleZRLETile,REALBPP)
+#define HandleZRLETiles CONCAT2E(HandleZRLETiles,REALBPP)
+#define HandleZRLETileJob CONCAT2E(HandleZRLETileJob,REALBPP)
+#define ZRLETileLength CONCAT2E(ZRLETileLength,REALBPP)
 #elif UNCOMP>0
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Down)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Down)
+#define HandleZRLETiles CONCAT3E(HandleZRLETiles,REALBPP,Down)
+#define HandleZRLETileJob CONCAT3E(HandleZRLETileJob,REALBPP,Down)
+#define ZRLETileLength CONCAT3E(ZRLETileLength,REALBPP,Down)
 #else
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Up)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Up)
+#define HandleZRLETiles CONCAT3E(HandleZRLETiles,REALBPP,Up)
+#define HandleZRLETileJob CONCAT3E(HandleZRLETileJob,REALBPP,Up)
+#define ZRLETileLength CONCAT3E(ZRLETileLength,REALBPP,Up)
 #endif
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 #define CARDREALBPP CONCAT3E(uint,REALBPP,_t)
@@ -76,9 +85,40 @@
 #endif
 #undef CPIXEL
 
+#ifndef ZRLE_TILE_JOBS_DEFINED
+#define ZRLE_TILE_JOBS_DEFINED
+typedef struct {
+	size_t offset;
+	int result;
+} ZRLETile;
+
+typedef struct {
+	rfbClient* client;
+	uint8_t* buffer;
+	size_t buffer_length;
+	int rx, ry, rw, rh;
+	int tiles_per_row;
+	ZRLETile* tiles;
+} ZRLETileJobs;
+
+static void ZRLETileRect(const ZRLETileJobs* jobs, int index,
+		int* x, int* y, int* w, int* h) {
+	int i = (index % jobs->tiles_per_row) * rfbZRLETileWidth;
+	int j = (index / jobs->tiles_per_row) * rfbZRLETileHeight;
+
+	*x = jobs->rx + i;
+	*y = jobs->ry + j;
+	*w = (i+rfbZRLETileWidth>jobs->rw)?jobs->rw-i:rfbZRLETileWidth;
+	*h = (j+rfbZRLETileHeight>jobs->rh)?jobs->rh-j:rfbZRLETileHeight;
+}
+#endif
+
 static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer,size_t buffer_length,
 	int x,int y,int w,int h);
+static rfbBool HandleZRLETiles(rfbClient* client,
+	uint8_t* buffer,size_t buffer_length,
+	int rx,int ry,int rw,int rh);
 
 static rfbBool
 HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
@@ -145,18 +185,17 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 	while (( remaining > 0 ) &&
 			( inflateResult == Z_OK )) {
 
-		if ( remaining > RFB_BUFFER_SIZE ) {
-			toRead = RFB_BUFFER_SIZE;
-		}
-		else {
-			toRead = remaining;
-		}
+		const char* span;
 
-		/* Fill the buffer, obtaining data from the server. */
-		if (!ReadFromRFBServer(client, client->buffer,toRead))
+		/* Inflate straight out of the socket buffer, using whatever is
+		 * already there and waiting for at least one byte. */
+		if (!PeekFromRFBServer(client, &span, 1))
 			return FALSE;
 
-		client->decompStream.next_in  = ( Bytef * )client->buffer;
+		toRead = (unsigned int)remaining < client->buffered ?
+			remaining : (int)client->buffered;
+
+		client->decompStream.next_in  = ( Bytef * )span;
 		client->decompStream.avail_in = toRead;
 
 		/* Need to uncompress buffer full. */
@@ -184,6 +223,7 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 			return FALSE;
 		}
 
+		SkipFromRFBServer(client, toRead);
 		remaining -= toRead;
 
 	} /* while ( remaining > 0 ) */
@@ -194,6 +234,9 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 		remaining = client->raw_buffer_size-client->decompStream.avail_out;
 
+		if(HandleZRLETiles(client,(uint8_t *)buf,remaining,rx,ry,rw,rh))
+			return TRUE;
+
 		for(j=0; j<rh; j+=rfbZRLETileHeight)
 			for(i=0; i<rw; i+=rfbZRLETileWidth) {
 				int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
@@ -415,10 +458,173 @@ static int HandleZRLETile(rfbClient* client,
 	return buffer-buffer_copy;	
 }
 
+/*
+ * Tiles only depend on their own part of the inflated stream, so once the
+ * stream has been indexed, they can be expanded into the framebuffer in
+ * parallel. The index is built by ZRLETileLength(), which walks the tile
+ * headers and run lengths without touching any pixels.
+ */
+
+static int ZRLETileLength(const uint8_t* buffer,size_t buffer_length,int w,int h) {
+	const uint8_t* buffer_copy = buffer;
+	const uint8_t* buffer_end = buffer+buffer_length;
+	uint8_t type;
+	int pixels = w*h;
+
+	if(buffer_length<1)
+		return -2;
+
+	type = *buffer;
+	buffer++;
+
+	if( type == 0 ) /* raw */
+	{
+		if(1+w*h*REALBPP/8>buffer_length)
+			return -3;
+		return 1+w*h*REALBPP/8;
+	}
+	else if( type == 1 ) /* solid */
+	{
+		if(1+REALBPP/8>buffer_length)
+			return -4;
+		return 1+REALBPP/8;
+	}
+	else if( type <= 127 ) /* packed Palette */
+	{
+		int bpp=(type>4?(type>16?8:4):(type>2?2:1)),
+			divider=(8/bpp);
+
+		if(1+type*REALBPP/8+((w+divider-1)/divider)*h>buffer_length)
+			return -5;
+		return 1+type*REALBPP/8+((w+divider-1)/divider)*h;
+	}
+	else if( type == 129 ) /* unused */
+	{
+		return -8;
+	}
+	else if( type >= 130 ) /* palette RLE */
+	{
+		if(2+(type-128)*REALBPP/8>buffer_length)
+			return -9;
+		buffer+=(type-128)*REALBPP/8;
+	}
+
+	while(pixels>0) {
+		int length=1;
+
+		if( type == 128 ) {
+			/* skip color */
+			if(buffer+REALBPP/8+1>buffer_end)
+				return -7;
+			buffer+=REALBPP/8;
+		} else {
+			if(buffer>=buffer_end)
+				return -10;
+			if(!(*buffer&0x80)) {
+				buffer++;
+				pixels--;
+				continue;
+			}
+			if(buffer+1>=buffer_end)
+				return -11;
+			buffer++;
+		}
+
+		/* read run length */
+		while(*buffer==0xff) {
+			if(buffer+1>=buffer_end)
+				return -8;
+			length+=*buffer;
+			buffer++;
+		}
+		length+=*buffer;
+		buffer++;
+
+		pixels-=length;
+	}
+
+	return buffer-buffer_copy;
+}
+
+static void HandleZRLETileJob(void* userdata, int job, int worker) {
+	ZRLETileJobs* jobs = userdata;
+	ZRLETile* tile = &jobs->tiles[job];
+	int x,y,w,h;
+
+	ZRLETileRect(jobs, job, &x, &y, &w, &h);
+	tile->result = HandleZRLETile(jobs->client,
+			jobs->buffer+tile->offset, jobs->buffer_length-tile->offset,
+			x, y, w, h);
+}
+
+static rfbBool HandleZRLETiles(rfbClient* client,
+		uint8_t* buffer,size_t buffer_length,
+		int rx,int ry,int rw,int rh) {
+	ZRLETileJobs jobs;
+	int n_tiles,i;
+	size_t offset = 0;
+
+	if(!client->workerPool)
+		return FALSE;
+
+#if BPP!=8
+	/* ZYWRLE synthesis shares client->zlib_buffer between tiles */
+	if(!(client->appData.qualityLevel & 0x80) &&
+			3 - client->appData.qualityLevel / 3 > 0)
+		return FALSE;
+#endif
+
+	jobs.client = client;
+	jobs.buffer = buffer;
+	jobs.buffer_length = buffer_length;
+	jobs.rx = rx;
+	jobs.ry = ry;
+	jobs.rw = rw;
+	jobs.rh = rh;
+	jobs.tiles_per_row = (rw+rfbZRLETileWidth-1)/rfbZRLETileWidth;
+
+	n_tiles = jobs.tiles_per_row*((rh+rfbZRLETileHeight-1)/rfbZRLETileHeight);
+	if(n_tiles<2)
+		return FALSE;
+
+	jobs.tiles = malloc(n_tiles*sizeof(*jobs.tiles));
+	if(!jobs.tiles)
+		return FALSE;
+
+	for(i=0; i<n_tiles; i++) {
+		int x,y,w,h,result;
+
+		ZRLETileRect(&jobs, i, &x, &y, &w, &h);
+		result = ZRLETileLength(buffer+offset, buffer_length-offset, w, h);
+		if(result<0) {
+			/* Let the sequential decoder deal with broken streams */
+			free(jobs.tiles);
+			return FALSE;
+		}
+
+		jobs.tiles[i].offset = offset;
+		offset += result;
+	}
+
+	worker_pool_run(client->workerPool, HandleZRLETileJob, &jobs, n_tiles);
+
+	for(i=0; i<n_tiles; i++)
+		if(jobs.tiles[i].result<0) {
+			rfbClientLog("ZRLE decoding failed (%d)\n",jobs.tiles[i].result);
+			break;
+		}
+
+	free(jobs.tiles);
+	return TRUE;
+}
+
 #undef CARDBPP
 #undef CARDREALBPP
 #undef HandleZRLE
 #undef HandleZRLETile
+#undef HandleZRLETiles
+#undef HandleZRLETileJob
+#undef ZRLETileLength
 #undef UncompressCPixel
 
 #endif
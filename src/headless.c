@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "headless.h"
+#include "vnc.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <aml.h>
+
+#define HEADLESS_REPORT_PERIOD UINT64_C(1000000) // us
+
+struct headless_stats {
+	uint64_t start_time;
+	uint64_t start_bytes;
+	uint64_t n_updates;
+	uint64_t n_pixels;
+	uint64_t update_time; // us, summed over all updates
+	uint64_t max_update_time; // us
+};
+
+struct headless {
+	struct vnc_client* vnc;
+	void* fb;
+	struct aml_ticker* ticker;
+
+	struct headless_stats total;
+	struct headless_stats period;
+};
+
+static void headless_stats_reset(struct headless_stats* stats,
+		const struct vnc_client* vnc, uint64_t now)
+{
+	*stats = (struct headless_stats){
+		.start_time = now,
+		.start_bytes = vnc->client->bytesReceived,
+	};
+}
+
+static void headless_stats_add(struct headless_stats* stats,
+		uint64_t pixels, uint64_t update_time)
+{
+	stats->n_updates++;
+	stats->n_pixels += pixels;
+	stats->update_time += update_time;
+	if (update_time > stats->max_update_time)
+		stats->max_update_time = update_time;
+}
+
+static void headless_stats_print(const struct headless_stats* stats,
+		const struct vnc_client* vnc, uint64_t now, FILE* stream)
+{
+	double elapsed = (now - stats->start_time) / 1.0e6;
+	double megabytes = (vnc->client->bytesReceived - stats->start_bytes) /
+		1.0e6;
+	double megapixels = stats->n_pixels / 1.0e6;
+	double mean_update_time = stats->n_updates ?
+		(double)stats->update_time / stats->n_updates / 1.0e3 : 0.0;
+
+	if (elapsed <= 0.0)
+		return;
+
+	fprintf(stream, "%.1f updates/s, %.2f MB/s, %.1f Mpixels/s, update time: %.2f ms mean, %.2f ms max, round trip: %.2f ms\n",
+			stats->n_updates / elapsed, megabytes / elapsed,
+			megapixels / elapsed, mean_update_time,
+			stats->max_update_time / 1.0e3,
+			vnc->client->fenceRoundTrip / 1.0e3);
+}
+
+static int headless_alloc_fb(struct vnc_client* vnc)
+{
+	struct headless* self = vnc->userdata;
+	size_t size = (size_t)vnc_client_get_stride(vnc) *
+		vnc_client_get_height(vnc);
+
+	void* fb = realloc(self->fb, size);
+	if (!fb)
+		return -1;
+
+	self->fb = fb;
+	vnc_client_set_fb(vnc, fb);
+	return 0;
+}
+
+static void headless_update_fb(struct vnc_client* vnc)
+{
+	struct headless* self = vnc->userdata;
+	uint64_t update_time = gettime_us() - vnc->update_start;
+
+	headless_stats_add(&self->total, vnc->update_pixels, update_time);
+	headless_stats_add(&self->period, vnc->update_pixels, update_time);
+}
+
+static void headless_on_tick(struct aml_ticker* ticker)
+{
+	struct headless* self = aml_get_userdata(ticker);
+	uint64_t now = gettime_us();
+
+	headless_stats_print(&self->period, self->vnc, now, stderr);
+	headless_stats_reset(&self->period, self->vnc, now);
+}
+
+struct headless* headless_create(struct vnc_client* vnc,
+		bool report_periodically)
+{
+	struct headless* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->vnc = vnc;
+
+	uint64_t now = gettime_us();
+	headless_stats_reset(&self->total, vnc, now);
+	headless_stats_reset(&self->period, vnc, now);
+
+	if (report_periodically) {
+		self->ticker = aml_ticker_new(HEADLESS_REPORT_PERIOD,
+				headless_on_tick, self, NULL);
+		if (!self->ticker)
+			goto failure;
+
+		if (aml_start(aml_get_default(), self->ticker) < 0)
+			goto failure;
+	}
+
+	vnc->alloc_fb = headless_alloc_fb;
+	vnc->update_fb = headless_update_fb;
+	vnc->userdata = self;
+
+	return self;
+
+failure:
+	if (self->ticker)
+		aml_unref(self->ticker);
+	free(self);
+	return NULL;
+}
+
+void headless_destroy(struct headless* self)
+{
+	struct rusage usage = { 0 };
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%" PRIu64 " updates, %.1f MB, %.1f Mpixels in %.3f s\n",
+			self->total.n_updates,
+			(self->vnc->client->bytesReceived -
+			 self->total.start_bytes) / 1.0e6,
+			self->total.n_pixels / 1.0e6,
+			(gettime_us() - self->total.start_time) / 1.0e6);
+	headless_stats_print(&self->total, self->vnc, gettime_us(), stdout);
+	printf("Peak RSS: %ld kB\n", usage.ru_maxrss);
+
+	if (self->ticker) {
+		aml_stop(aml_get_default(), self->ticker);
+		aml_unref(self->ticker);
+	}
+
+	vnc_client_set_fb(self->vnc, NULL);
+	free(self->fb);
+	free(self);
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "latency-stats.h"
+#include "presentation-time.h"
+#include "time-util.h"
+#include "usdt.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <wayland-client.h>
+#include <aml.h>
+
+// Beyond this, the server's clock is assumed not to be ours
+#define LATENCY_MAX_PLAUSIBLE INT64_C(10000000) // us
+
+struct latency_stats {
+	struct wp_presentation* presentation;
+	struct aml_ticker* ticker;
+
+	// Feedback that the compositor has not sent yet
+	struct wl_list pending;
+
+	int64_t* samples; // us
+	int n_samples;
+	int samples_size;
+	uint64_t n_discarded;
+};
+
+struct latency_feedback {
+	struct latency_stats* stats;
+	struct wp_presentation_feedback* feedback;
+	uint64_t pts;
+	struct wl_list link;
+};
+
+static void latency_feedback_destroy(struct latency_feedback* self)
+{
+	wp_presentation_feedback_destroy(self->feedback);
+	wl_list_remove(&self->link);
+	free(self);
+}
+
+static void latency_stats_add_sample(struct latency_stats* self,
+		int64_t latency)
+{
+	if (self->n_samples == self->samples_size) {
+		int size = self->samples_size ? self->samples_size * 2 : 256;
+		int64_t* samples = realloc(self->samples,
+				size * sizeof(*samples));
+		if (!samples)
+			return;
+
+		self->samples = samples;
+		self->samples_size = size;
+	}
+
+	self->samples[self->n_samples++] = latency;
+}
+
+static void handle_feedback_sync_output(void* data,
+		struct wp_presentation_feedback* feedback,
+		struct wl_output* output)
+{
+}
+
+static void handle_feedback_presented(void* data,
+		struct wp_presentation_feedback* feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+	struct latency_feedback* self = data;
+
+	struct timespec ts = {
+		.tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
+	uint64_t present_time = timespec_to_us(&ts);
+	int64_t latency = (int64_t)(present_time - self->pts);
+
+	DTRACE_PROBE3(wlvncc, frame_latency, self->pts, present_time, latency);
+
+	latency_stats_add_sample(self->stats, latency);
+	latency_feedback_destroy(self);
+}
+
+static void handle_feedback_discarded(void* data,
+		struct wp_presentation_feedback* feedback)
+{
+	struct latency_feedback* self = data;
+
+	self->stats->n_discarded++;
+	latency_feedback_destroy(self);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = handle_feedback_sync_output,
+	.presented = handle_feedback_presented,
+	.discarded = handle_feedback_discarded,
+};
+
+static int compare_samples(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a;
+	int64_t y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t* sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static void latency_stats_report(struct latency_stats* self)
+{
+	int n = self->n_samples;
+
+	if (n == 0) {
+		if (self->n_discarded)
+			fprintf(stderr, "Latency: %" PRIu64 " frames discarded, none presented\n",
+					self->n_discarded);
+		self->n_discarded = 0;
+		return;
+	}
+
+	int64_t* s = self->samples;
+	qsort(s, n, sizeof(*s), compare_samples);
+
+	/* With different clocks at either end, the minimum is the best
+	 * available stand-in for the fixed offset between them.
+	 */
+	bool same_clock = s[0] >= 0 && s[n - 1] <= LATENCY_MAX_PLAUSIBLE;
+	int64_t offset = same_clock ? 0 : s[0];
+
+	fprintf(stderr, "Latency%s: %d frames, %" PRIu64 " discarded, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+			same_clock ? "" : " above minimum", n,
+			self->n_discarded,
+			(percentile(s, n, 0.5) - offset) / 1.0e3,
+			(percentile(s, n, 0.9) - offset) / 1.0e3,
+			(percentile(s, n, 0.99) - offset) / 1.0e3,
+			(s[n - 1] - offset) / 1.0e3);
+
+	self->n_samples = 0;
+	self->n_discarded = 0;
+}
+
+static void latency_stats_on_tick(struct aml_ticker* ticker)
+{
+	latency_stats_report(aml_get_userdata(ticker));
+}
+
+struct latency_stats* latency_stats_create(
+		struct wp_presentation* presentation, int period)
+{
+	struct latency_stats* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->presentation = presentation;
+	wl_list_init(&self->pending);
+
+	self->ticker = aml_ticker_new(period * UINT64_C(1000000),
+			latency_stats_on_tick, self, NULL);
+	if (!self->ticker)
+		goto failure;
+
+	if (aml_start(aml_get_default(), self->ticker) < 0)
+		goto failure;
+
+	return self;
+
+failure:
+	if (self->ticker)
+		aml_unref(self->ticker);
+	free(self);
+	return NULL;
+}
+
+void latency_stats_destroy(struct latency_stats* self)
+{
+	if (!self)
+		return;
+
+	latency_stats_report(self);
+
+	struct latency_feedback* feedback;
+	struct latency_feedback* tmp;
+	wl_list_for_each_safe(feedback, tmp, &self->pending, link)
+		latency_feedback_destroy(feedback);
+
+	aml_stop(aml_get_default(), self->ticker);
+	aml_unref(self->ticker);
+	free(self->samples);
+	free(self);
+}
+
+void latency_stats_track_commit(struct latency_stats* self,
+		struct wl_surface* surface, uint64_t pts)
+{
+	struct latency_feedback* feedback = calloc(1, sizeof(*feedback));
+	if (!feedback)
+		return;
+
+	feedback->feedback = wp_presentation_feedback(self->presentation,
+			surface);
+	if (!feedback->feedback) {
+		free(feedback);
+		return;
+	}
+
+	feedback->stats = self;
+	feedback->pts = pts;
+	wl_list_insert(&self->pending, &feedback->link);
+
+	wp_presentation_feedback_add_listener(feedback->feedback,
+			&feedback_listener, feedback);
+}
@@ -37,6 +37,7 @@
 #include "viewporter-v1.h"
 #include "single-pixel-buffer-v1.h"
 #include "xdg-decoration-unstable-v1.h"
+#include "presentation-time.h"
 #include "pixman.h"
 #include "xdg-shell.h"
 #include "shm.h"
@@ -52,10 +53,20 @@
 #include "linux-dmabuf-v1.h"
 #include "time-util.h"
 #include "output.h"
+#include "usdt.h"
+#include "headless.h"
+#include "encoding-stats.h"
+#include "latency-stats.h"
 
 #define CANARY_TICK_PERIOD INT64_C(100000) // us
 #define CANARY_LETHALITY_LEVEL INT64_C(8000) // us
 
+#define WINDOW_DAMAGE_HISTORY 4
+
+#define WINDOW_MIN_BUFFERS 2
+#define WINDOW_MAX_BUFFERS 8
+#define WINDOW_BUFFER_IDLE_TIMEOUT INT64_C(2000000) // us
+
 struct point {
 	double x, y;
 };
@@ -77,14 +88,49 @@ struct window {
 	int width, height;
 	int32_t scale;
 
-	struct buffer* buffers[3];
+	struct buffer* buffers[WINDOW_MAX_BUFFERS];
+	int n_buffers;
+	int buffer_width, buffer_height;
 	struct buffer* back_buffer;
-	int buffer_index;
+	struct buffer* front_buffer;
+
+	// Surface damage that has not been committed yet
+	struct pixman_region16 pending_damage;
+
+	// Only one of these is set while waiting to commit the next frame
+	struct wl_callback* frame_callback;
+	struct wp_presentation_feedback* presentation_feedback;
+	uint64_t commit_time;
+
+	uint64_t frame_seq;
+	struct pixman_region16 damage_history[WINDOW_DAMAGE_HISTORY];
+
+	// PTS of the newest update in pending_damage
+	uint64_t pending_pts;
 
 	struct vnc_client* vnc;
 	void* vnc_fb;
 };
 
+/* What to do when the compositor is holding on to all the buffers and no
+ * more can be allocated.
+ */
+enum busy_policy {
+	// Skip frames until the next update finds a free buffer
+	BUSY_POLICY_DROP = 0,
+	// Also present the skipped frames as soon as a buffer is released
+	BUSY_POLICY_COALESCE,
+};
+
+enum frame_pacing {
+	// Commit as soon as a frame has been rendered
+	FRAME_PACING_NONE = 0,
+	// Commit when the compositor asks for the next frame
+	FRAME_PACING_FRAME_CALLBACK,
+	// Commit when the last frame has been shown or discarded
+	FRAME_PACING_PRESENTATION,
+};
+
 struct format_table_entry {
 	uint32_t format;
 	uint32_t padding;
@@ -117,10 +163,33 @@ static bool decorations = true;
 
 static bool have_egl = false;
 static bool shortcut_inhibit = false;
+static bool use_decode_thread = false;
+static bool use_gpu_jpeg = false;
+static bool use_direct_fb = false;
+static int max_buffers = 4;
+static enum busy_policy busy_policy = BUSY_POLICY_COALESCE;
+static enum frame_pacing frame_pacing = FRAME_PACING_FRAME_CALLBACK;
+static struct wp_presentation* wp_presentation;
+static clockid_t presentation_clock = -1; // Until the compositor says
 
 static uint32_t shm_format = DRM_FORMAT_INVALID;
 static uint32_t dmabuf_format = DRM_FORMAT_INVALID;
 
+static const char* encodings = NULL;
+static int quality = -1;
+static int compression = -1;
+static bool use_continuous_updates = true;
+static int request_window = 1;
+static int decode_workers = 0; // One per CPU
+static bool use_adaptive_quality = false;
+static int low_bandwidth_threshold = 0; // kbit/s
+static const char* record_path = NULL;
+static int stats_period = 0; // s
+static const char* stats_socket_path = NULL;
+static struct encoding_stats* encoding_stats = NULL;
+static int latency_stats_period = 0; // s
+static struct latency_stats* latency_stats = NULL;
+
 static bool do_run = true;
 
 struct window* window = NULL;
@@ -150,6 +219,16 @@ static void on_seat_capability_change(struct seat* seat)
 	}
 }
 
+static void handle_presentation_clock_id(void* data,
+		struct wp_presentation* presentation, uint32_t clk_id)
+{
+	presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = handle_presentation_clock_id,
+};
+
 static void registry_add(void* data, struct wl_registry* registry, uint32_t id,
 		const char* interface, uint32_t version)
 {
@@ -181,6 +260,9 @@ static void registry_add(void* data, struct wl_registry* registry, uint32_t id,
 		single_pixel_manager = wl_registry_bind(registry, id, &wp_single_pixel_buffer_manager_v1_interface, 1);
 	} else if (strcmp(interface, zxdg_decoration_manager_v1_interface.name) == 0 && decorations) {
 		decoration_manager = wl_registry_bind(registry, id, &zxdg_decoration_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		wp_presentation = wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+		wp_presentation_add_listener(wp_presentation, &presentation_listener, NULL);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		struct wl_seat* wl_seat;
 		wl_seat = wl_registry_bind(registry, id, &wl_seat_interface, 5);
@@ -434,31 +516,123 @@ static void window_calculate_buffer(struct window* w, double* scale,
 	}
 }
 
+static void window_get_image(struct window* w, struct image* image)
+{
+	*image = (struct image){
+		.pixels = w->vnc_fb,
+		.width = vnc_client_get_width(w->vnc),
+		.height = vnc_client_get_height(w->vnc),
+		.stride = vnc_client_get_stride(w->vnc),
+		.format = vnc_client_get_pixel_format(w->vnc),
+		.damage = &w->vnc->damage,
+	};
+}
+
+/* Fills in what the back buffer missed around H.264 frames. The front buffer
+ * holds everything up to its own frame, and the frames that were skipped
+ * after it have been imported into the texture. If that history is gone,
+ * the whole framebuffer is requested again.
+ */
+static void window_fill_stale(struct window* w, struct pixman_region16* stale)
+{
+	struct buffer* front = w->front_buffer;
+
+	if (!front || front->seq == 0 ||
+			w->frame_seq - front->seq > WINDOW_DAMAGE_HISTORY) {
+		vnc_client_request_refresh(w->vnc);
+		return;
+	}
+
+	egl_copy_buffer(w->back_buffer, front, stale);
+
+	if (front->seq == w->frame_seq - 1)
+		return;
+
+	struct pixman_region16 skipped;
+	pixman_region_init(&skipped);
+
+	for (uint64_t seq = front->seq + 1; seq < w->frame_seq; ++seq)
+		pixman_region_union(&skipped, &skipped,
+				&w->damage_history[seq % WINDOW_DAMAGE_HISTORY]);
+
+	pixman_region_intersect(&skipped, &skipped, stale);
+
+	if (pixman_region_not_empty(&skipped)) {
+		// draw_image_egl() draws the buffer damage, so it is set aside
+		struct pixman_region16 damage;
+		pixman_region_init(&damage);
+		pixman_region_copy(&damage, &w->back_buffer->damage);
+		pixman_region_copy(&w->back_buffer->damage, &skipped);
+
+		struct image image;
+		window_get_image(w, &image);
+		draw_image_egl(w->back_buffer, &image);
+
+		pixman_region_copy(&w->back_buffer->damage, &damage);
+		pixman_region_fini(&damage);
+	}
+
+	pixman_region_fini(&skipped);
+}
+
 static void window_transfer_pixels(struct window* w)
 {
+	uint64_t start __attribute__((unused)) = gettime_us();
+
 	if (w->vnc->n_av_frames != 0) {
 		assert(have_egl);
 
 		if (pixman_region_not_empty(&w->vnc->damage))
 			fprintf(stderr, "Oops, got both av frames and buffer damage\n");
 
+		/* The frames only cover the current damage, so anything else
+		 * that the back buffer missed is filled in first.
+		 */
+		struct pixman_region16* frame_damage =
+			&w->damage_history[w->frame_seq % WINDOW_DAMAGE_HISTORY];
+
+		struct pixman_region16 stale;
+		pixman_region_init(&stale);
+		pixman_region_subtract(&stale, &w->back_buffer->damage,
+				frame_damage);
+		if (pixman_region_not_empty(&stale))
+			window_fill_stale(w, &stale);
+		pixman_region_fini(&stale);
+
+		pixman_region_intersect(&w->back_buffer->damage,
+				&w->back_buffer->damage, frame_damage);
+
 		render_av_frames_egl(w->back_buffer, w->vnc->av_frames,
 				w->vnc->n_av_frames);
+		DTRACE_PROBE1(wlvncc, window_transfer_pixels,
+				gettime_us() - start);
 		return;
 	}
 
-	struct image image = {
-		.pixels = w->vnc_fb,
-		.width = vnc_client_get_width(w->vnc),
-		.height = vnc_client_get_height(w->vnc),
-		.stride = vnc_client_get_stride(w->vnc),
-		// TODO: Get the format from the vnc module
-		.format = w->back_buffer->format,
-		.damage = &w->vnc->damage,
-	};
+	struct image image;
+	window_get_image(w, &image);
+
+	if (have_egl) {
+		if (render_image_egl(w->back_buffer, &image,
+					w->vnc->render_ops,
+					w->vnc->n_render_ops) < 0)
+			vnc_client_disable_gpu_copy_rect(w->vnc);
+	} else
+		render_image(w->back_buffer, &image);
+
+	DTRACE_PROBE1(wlvncc, window_transfer_pixels, gettime_us() - start);
+}
+
+/* Repaints the back buffer from the decoded framebuffer, or from the texture
+ * that mirrors it, without taking in a new frame.
+ */
+static void window_redraw(struct window* w)
+{
+	struct image image;
+	window_get_image(w, &image);
 
 	if (have_egl)
-		render_image_egl(w->back_buffer, &image);
+		draw_image_egl(w->back_buffer, &image);
 	else
 		render_image(w->back_buffer, &image);
 }
@@ -469,10 +643,113 @@ static void window_commit(struct window* w)
 	wl_surface_commit(w->wl_surface);
 }
 
-static void window_swap(struct window* w)
+static void on_buffer_release(struct buffer* buffer);
+
+static struct buffer* window_create_buffer(struct window* w)
+{
+	if (w->n_buffers >= WINDOW_MAX_BUFFERS)
+		return NULL;
+
+	int width = w->buffer_width;
+	int height = w->buffer_height;
+
+	struct buffer* buffer = have_egl
+		? buffer_create_dmabuf(width, height, dmabuf_format)
+		: buffer_create_shm(width, height, 4 * width, shm_format);
+	if (!buffer)
+		return NULL;
+
+	buffer->on_release = on_buffer_release;
+	buffer->userdata = w;
+	buffer->last_used = gettime_us();
+
+	w->buffers[w->n_buffers++] = buffer;
+	return buffer;
+}
+
+static void window_destroy_buffers(struct window* w)
+{
+	for (int i = 0; i < w->n_buffers; ++i)
+		buffer_destroy(w->buffers[i]);
+
+	w->n_buffers = 0;
+	w->back_buffer = NULL;
+	w->front_buffer = NULL;
+}
+
+/* Returns the released buffer that was updated most recently, because it has
+ * the least damage to repaint. If the compositor is holding on to all of
+ * them, the pool is grown, up to a limit.
+ */
+static struct buffer* window_find_free_buffer(struct window* w)
+{
+	struct buffer* best = NULL;
+
+	for (int i = 0; i < w->n_buffers; ++i) {
+		struct buffer* buffer = w->buffers[i];
+		if (buffer == w->front_buffer || buffer == w->back_buffer ||
+				buffer->is_attached)
+			continue;
+
+		if (!best || buffer->seq > best->seq)
+			best = buffer;
+	}
+
+	if (best || w->n_buffers >= max_buffers)
+		return best;
+
+	DTRACE_PROBE1(wlvncc, window_grow_buffers, w->n_buffers + 1);
+	return window_create_buffer(w);
+}
+
+// Returns the most recent buffer that is not on screen, even if it is attached
+static struct buffer* window_steal_buffer(struct window* w)
+{
+	struct buffer* best = NULL;
+
+	for (int i = 0; i < w->n_buffers; ++i) {
+		struct buffer* buffer = w->buffers[i];
+		if (buffer == w->front_buffer)
+			continue;
+
+		if (!best || buffer->seq > best->seq)
+			best = buffer;
+	}
+
+	return best;
+}
+
+// Releases buffers that have not been used for a while
+static void window_shrink_buffers(struct window* w)
+{
+	uint64_t now = gettime_us();
+
+	int i = 0;
+	while (i < w->n_buffers && w->n_buffers > WINDOW_MIN_BUFFERS) {
+		struct buffer* buffer = w->buffers[i];
+		if (buffer == w->front_buffer || buffer == w->back_buffer ||
+				buffer->is_attached ||
+				now - buffer->last_used < WINDOW_BUFFER_IDLE_TIMEOUT) {
+			++i;
+			continue;
+		}
+
+		buffer_destroy(buffer);
+		w->buffers[i] = w->buffers[--w->n_buffers];
+		DTRACE_PROBE1(wlvncc, window_shrink_buffers, w->n_buffers);
+	}
+}
+
+/* The committed back buffer becomes the front buffer. The next back buffer
+ * may be NULL, in which case one is looked for when the next frame arrives.
+ */
+static void window_swap(struct window* w, struct buffer* next)
 {
-	w->buffer_index = (w->buffer_index + 1) % 3;
-	w->back_buffer = w->buffers[w->buffer_index];
+	w->front_buffer = w->back_buffer;
+	w->front_buffer->last_used = gettime_us();
+	w->back_buffer = next;
+
+	window_shrink_buffers(w);
 }
 
 static void window_damage_buffer(struct window* w, int x, int y, int width, int height)
@@ -625,6 +902,11 @@ static struct window* window_create(const char* app_id, const char* title)
 		return NULL;
 
 	w->preferred_buffer_scale = 0;
+	w->pending_pts = NO_PTS;
+
+	for (int i = 0; i < WINDOW_DAMAGE_HISTORY; ++i)
+		pixman_region_init(&w->damage_history[i]);
+	pixman_region_init(&w->pending_damage);
 
 	if (single_pixel_manager)
 		w->wl_bg_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
@@ -703,8 +985,14 @@ wl_bg_surface_failure:
 
 static void window_destroy(struct window* w)
 {
-	for (int i = 0; i < 3; ++i)
-		buffer_destroy(w->buffers[i]);
+	window_destroy_buffers(w);
+	for (int i = 0; i < WINDOW_DAMAGE_HISTORY; ++i)
+		pixman_region_fini(&w->damage_history[i]);
+	pixman_region_fini(&w->pending_damage);
+	if (w->frame_callback)
+		wl_callback_destroy(w->frame_callback);
+	if (w->presentation_feedback)
+		wp_presentation_feedback_destroy(w->presentation_feedback);
 	if (w->wl_bg_pixels)
 		munmap(w->wl_bg_pixels, 4);
 	wl_buffer_destroy(w->wl_bg_buffer);
@@ -812,14 +1100,28 @@ int on_vnc_client_alloc_fb(struct vnc_client* client)
 		window_resize(window, width, height);
 	}
 
-	for (int i = 0; i < 3; ++i) {
-		window->buffers[i] = have_egl
-			? buffer_create_dmabuf(width, height, dmabuf_format)
-			: buffer_create_shm(width, height, 4 * width, shm_format);
-	}
+	window_destroy_buffers(window);
+	pixman_region_clear(&window->pending_damage);
+
+	window->buffer_width = width;
+	window->buffer_height = height;
+
+	for (int i = 0; i < WINDOW_MIN_BUFFERS; ++i)
+		window_create_buffer(window);
 	window->back_buffer = window->buffers[0];
 
 	free(window->vnc_fb);
+	window->vnc_fb = NULL;
+
+	/* In direct mode, the decoders write into the back buffer, which is
+	 * swapped out for the next one when the frame is committed.
+	 */
+	if (use_direct_fb) {
+		assert(window->back_buffer);
+		vnc_client_set_fb(client, window->back_buffer->pixels);
+		return 0;
+	}
+
 	window->vnc_fb = malloc(height * stride);
 	assert(window->vnc_fb);
 
@@ -838,13 +1140,41 @@ static void get_frame_damage(struct vnc_client* client,
 		pixman_region_union_rect(damage, damage, frame->x, frame->y,
 				frame->width, frame->height);
 	}
+
+	for (int i = 0; i < client->n_render_ops; ++i) {
+		const struct vnc_render_op* op = &client->render_ops[i];
+
+		pixman_region_union_rect(damage, damage, op->x, op->y,
+				op->width, op->height);
+	}
+}
+
+static void window_record_damage(struct window* w,
+		struct pixman_region16* damage)
+{
+	w->frame_seq++;
+	pixman_region_copy(
+			&w->damage_history[w->frame_seq % WINDOW_DAMAGE_HISTORY],
+			damage);
 }
 
-static void apply_buffer_damage(struct pixman_region16* damage)
+/* Adds everything that has changed since the buffer was last brought up to
+ * date to its damage. If that was too long ago, the whole buffer is
+ * repainted.
+ */
+static void window_age_buffer(struct window* w, struct buffer* buffer)
 {
-	for (int i = 0; i < 3; ++i)
-		pixman_region_union(&window->buffers[i]->damage,
-				&window->buffers[i]->damage, damage);
+	uint64_t age = w->frame_seq - buffer->seq;
+
+	if (buffer->seq == 0 || age > WINDOW_DAMAGE_HISTORY) {
+		pixman_region_union_rect(&buffer->damage, &buffer->damage, 0, 0,
+				buffer->width, buffer->height);
+		return;
+	}
+
+	for (uint64_t seq = buffer->seq + 1; seq <= w->frame_seq; ++seq)
+		pixman_region_union(&buffer->damage, &buffer->damage,
+				&w->damage_history[seq % WINDOW_DAMAGE_HISTORY]);
 }
 
 static void window_damage_region(struct window* w,
@@ -863,28 +1193,268 @@ static void window_damage_region(struct window* w,
 	}
 }
 
-void on_vnc_client_update_fb(struct vnc_client* client)
+/* Brings the new back buffer up to date with the buffer that was just
+ * committed and lets the decoders write into it.
+ */
+static void window_sync_back_buffer(struct window* w, struct buffer* front)
 {
-	if (!pixman_region_not_empty(&client->damage) &&
-			client->n_av_frames == 0)
+	window_age_buffer(w, w->back_buffer);
+
+	struct image image = {
+		.pixels = front->pixels,
+		.width = front->width,
+		.height = front->height,
+		.stride = front->stride,
+		.format = front->format,
+	};
+
+	render_image(w->back_buffer, &image);
+	w->back_buffer->seq = w->frame_seq;
+	vnc_client_set_fb(w->vnc, w->back_buffer->pixels);
+}
+
+static void window_present_pending(struct window* w);
+
+static bool window_is_frame_pending(struct window* w)
+{
+	return w->frame_callback || w->presentation_feedback;
+}
+
+static void window_frame_ready(struct window* w)
+{
+	if (pixman_region_not_empty(&w->pending_damage))
+		window_present_pending(w);
+}
+
+static void handle_frame_done(void* data, struct wl_callback* callback,
+		uint32_t time)
+{
+	struct window* w = data;
+
+	wl_callback_destroy(w->frame_callback);
+	w->frame_callback = NULL;
+
+	window_frame_ready(w);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = handle_frame_done,
+};
+
+static void handle_feedback_sync_output(void* data,
+		struct wp_presentation_feedback* feedback,
+		struct wl_output* output)
+{
+}
+
+static void handle_feedback_presented(void* data,
+		struct wp_presentation_feedback* feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+	struct window* w = data;
+
+	wp_presentation_feedback_destroy(w->presentation_feedback);
+	w->presentation_feedback = NULL;
+
+	struct timespec ts = {
+		.tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
+	uint64_t present_time __attribute__((unused)) = timespec_to_us(&ts);
+
+	if (presentation_clock == CLOCK_MONOTONIC)
+		DTRACE_PROBE2(wlvncc, window_presented,
+				present_time - w->commit_time, refresh);
+
+	window_frame_ready(w);
+}
+
+static void handle_feedback_discarded(void* data,
+		struct wp_presentation_feedback* feedback)
+{
+	struct window* w = data;
+
+	wp_presentation_feedback_destroy(w->presentation_feedback);
+	w->presentation_feedback = NULL;
+
+	DTRACE_PROBE(wlvncc, window_discarded);
+
+	window_frame_ready(w);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = handle_feedback_sync_output,
+	.presented = handle_feedback_presented,
+	.discarded = handle_feedback_discarded,
+};
+
+static void window_request_frame(struct window* w)
+{
+	switch (frame_pacing) {
+	case FRAME_PACING_NONE:
+		break;
+	case FRAME_PACING_FRAME_CALLBACK:
+		w->frame_callback = wl_surface_frame(w->wl_surface);
+		wl_callback_add_listener(w->frame_callback, &frame_listener, w);
+		break;
+	case FRAME_PACING_PRESENTATION:
+		w->presentation_feedback = wp_presentation_feedback(
+				wp_presentation, w->wl_surface);
+		wp_presentation_feedback_add_listener(w->presentation_feedback,
+				&feedback_listener, w);
+		break;
+	}
+}
+
+static void window_present(struct window* w)
+{
+	window_attach(w);
+	window_damage_region(w, &w->pending_damage);
+	pixman_region_clear(&w->pending_damage);
+	window_request_frame(w);
+	w->commit_time = gettime_us();
+	DTRACE_PROBE3(wlvncc, window_commit, w->back_buffer, w->frame_seq,
+			w->pending_pts);
+	if (latency_stats && w->pending_pts != NO_PTS)
+		latency_stats_track_commit(latency_stats, w->wl_surface,
+				w->pending_pts);
+	window_commit(w);
+}
+
+/* In direct mode, the back buffer already holds the frame, but it can only
+ * be committed if there is another buffer for the decoders to write into.
+ */
+static bool window_present_direct(struct window* w)
+{
+	struct buffer* next = window_find_free_buffer(w);
+	if (!next)
+		return false;
+
+	struct buffer* front = w->back_buffer;
+	pixman_region_clear(&front->damage);
+	front->seq = w->frame_seq;
+
+	window_present(w);
+	window_swap(w, next);
+	window_sync_back_buffer(w, front);
+	return true;
+}
+
+/* The frame is not shown, but its damage stays pending and the back buffer
+ * picks it up through its age when it is eventually rendered.
+ */
+static void window_skip_frame(struct window* w)
+{
+	DTRACE_PROBE1(wlvncc, window_skip_frame, w->frame_seq);
+
+	if (!have_egl)
 		return;
 
-	if (window->back_buffer->is_attached)
-		fprintf(stderr, "Oops, back-buffer is still attached.\n");
+	// The texture must still be kept up to date
+	struct image image;
+	window_get_image(w, &image);
+	if (import_image_egl(&image, w->vnc->render_ops,
+				w->vnc->n_render_ops) < 0)
+		vnc_client_disable_gpu_copy_rect(w->vnc);
+}
+
+/* Commits the damage that has built up since the last commit, if the back
+ * buffer is ready or can be brought up to date.
+ */
+static void window_present_pending(struct window* w)
+{
+	if (use_direct_fb) {
+		// The decode thread owns the back buffer between frames
+		if (!use_decode_thread)
+			window_present_direct(w);
+		return;
+	}
+
+	if (w->back_buffer && w->back_buffer->seq == w->frame_seq) {
+		window_present(w);
+		window_swap(w, NULL);
+		return;
+	}
+
+	// The decode thread owns the framebuffer between frames
+	if (!have_egl && use_decode_thread)
+		return;
+
+	if (!w->back_buffer)
+		w->back_buffer = window_find_free_buffer(w);
+
+	if (!w->back_buffer)
+		return;
+
+	window_age_buffer(w, w->back_buffer);
+	window_redraw(w);
+	w->back_buffer->seq = w->frame_seq;
+
+	window_present(w);
+	window_swap(w, NULL);
+}
 
-	window_attach(window);
+static void on_buffer_release(struct buffer* buffer)
+{
+	struct window* w = buffer->userdata;
+
+	if (busy_policy != BUSY_POLICY_COALESCE ||
+			window_is_frame_pending(w) ||
+			!pixman_region_not_empty(&w->pending_damage))
+		return;
+
+	window_present_pending(w);
+}
+
+void on_vnc_client_update_fb(struct vnc_client* client)
+{
+	if (!pixman_region_not_empty(&client->damage) &&
+			client->n_av_frames == 0 && client->n_render_ops == 0)
+		return;
 
 	struct pixman_region16 frame_damage = { 0 };
 	get_frame_damage(window->vnc, &frame_damage);
 
-	apply_buffer_damage(&frame_damage);
-	window_damage_region(window, &frame_damage);
+	window_record_damage(window, &frame_damage);
+	pixman_region_union(&window->pending_damage, &window->pending_damage,
+			&frame_damage);
 	pixman_region_fini(&frame_damage);
+	window->pending_pts = client->pts;
+
+	/* Damage from several updates is collected until the compositor is
+	 * ready for the next frame.
+	 */
+	if (use_direct_fb) {
+		if (window_is_frame_pending(window) ||
+				!window_present_direct(window))
+			DTRACE_PROBE1(wlvncc, window_skip_frame, window->frame_seq);
+		return;
+	}
+
+	if (!window->back_buffer)
+		window->back_buffer = window_find_free_buffer(window);
 
+	if (!window->back_buffer) {
+		// H.264 frames are not kept around, so they can't be skipped
+		if (client->n_av_frames == 0) {
+			window_skip_frame(window);
+			return;
+		}
+
+		fprintf(stderr, "Oops, back-buffer is still attached.\n");
+		window->back_buffer = window_steal_buffer(window);
+	}
+
+	window_age_buffer(window, window->back_buffer);
 	window_transfer_pixels(window);
+	window->back_buffer->seq = window->frame_seq;
 
-	window_commit(window);
-	window_swap(window);
+	if (window_is_frame_pending(window))
+		return;
+
+	window_present(window);
+	window_swap(window, NULL);
 }
 
 void on_vnc_client_event(struct aml_handler* handler)
@@ -908,6 +1478,27 @@ int init_vnc_client_handler(struct vnc_client* client)
 	return rc;
 }
 
+void on_vnc_thread_event(struct aml_handler* handler)
+{
+	struct vnc_client* client = aml_get_userdata(handler);
+	if (vnc_client_dispatch(client) < 0)
+		do_run = false;
+}
+
+int init_vnc_thread_handler(struct vnc_client* client)
+{
+	int fd = vnc_client_get_event_fd(client);
+
+	struct aml_handler* handler;
+	handler = aml_handler_new(fd, on_vnc_thread_event, client, NULL);
+	if (!handler)
+		return -1;
+
+	int rc = aml_start(aml_get_default(), handler);
+	aml_unref(handler);
+	return rc;
+}
+
 static int find_render_node(char *node, size_t maxlen) {
 	bool r = -1;
 	drmDevice *devices[64];
@@ -1043,11 +1634,189 @@ static void create_canary_ticker(void)
 void run_main_loop_once(void)
 {
 	struct aml* aml = aml_get_default();
-	wl_display_flush(wl_display);
+	if (wl_display)
+		wl_display_flush(wl_display);
 	aml_poll(aml, -1);
 	aml_dispatch(aml);
 }
 
+static int configure_vnc_client(struct vnc_client* vnc, uint32_t format)
+{
+	if (vnc_client_set_pixel_format(vnc, format) < 0) {
+		fprintf(stderr, "Unsupported pixel format\n");
+		return -1;
+	}
+
+	if (encodings) {
+		if (!have_egl && strstr(encodings, "open-h264")) {
+			fprintf(stderr, "Open H.264 encoding won't work without EGL\n");
+			return -1;
+		}
+	} else if (have_egl) {
+		encodings = "open-h264,tight,zrle,ultra,copyrect,hextile,zlib"
+			",corre,rre,raw";
+	} else {
+		encodings = "tight,zrle,ultra,copyrect,hextile,zlib,corre,rre,raw";
+	}
+	vnc_client_set_encodings(vnc, encodings);
+
+	if (quality >= 0)
+		vnc_client_set_quality_level(vnc, quality);
+
+	if (compression >= 0)
+		vnc_client_set_compression_level(vnc, compression);
+
+	vnc_client_set_continuous_updates(vnc, use_continuous_updates);
+	vnc_client_set_update_request_window(vnc, request_window);
+	vnc_client_set_adaptive_quality(vnc, use_adaptive_quality);
+	vnc_client_set_low_bandwidth_threshold(vnc,
+			(uint64_t)low_bandwidth_threshold * 1000 / 8);
+
+	if (decode_workers &&
+			vnc_client_set_decode_workers(vnc, decode_workers) < 0)
+		return -1;
+
+	vnc->use_thread = use_decode_thread;
+
+	if (use_gpu_jpeg && !have_egl)
+		fprintf(stderr, "GPU JPEG conversion won't work without EGL\n");
+	vnc->decode_jpeg_to_yuv = use_gpu_jpeg && have_egl;
+	vnc->gpu_copy_rect = have_egl && egl_texture_is_renderable(format);
+	vnc->record_path = record_path;
+
+	return 0;
+}
+
+static int connect_vnc_client(struct vnc_client* vnc, const char* address,
+		int port)
+{
+	if (vnc_client_connect(vnc, address, port) < 0) {
+		fprintf(stderr, "Failed to connect to server\n");
+		return -1;
+	}
+
+	if (!use_decode_thread && init_vnc_client_handler(vnc) < 0)
+		return -1;
+
+	if (vnc_client_init(vnc) < 0) {
+		fprintf(stderr, "Failed to connect to server\n");
+		return -1;
+	}
+
+	if (use_decode_thread && init_vnc_thread_handler(vnc) < 0)
+		return -1;
+
+	if (stats_period || stats_socket_path) {
+		encoding_stats = encoding_stats_create(vnc, stats_period,
+				stats_socket_path);
+		if (!encoding_stats)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Same as a normal session, minus the wayland display, the window and the
+ * renderers: updates are decoded into memory and then dropped.
+ */
+static int run_headless(const char* address, int port)
+{
+	int rc = -1;
+
+	struct vnc_client* vnc = vnc_client_create();
+	if (!vnc)
+		return -1;
+
+	struct headless* headless = headless_create(vnc, true);
+	if (!headless)
+		goto headless_failure;
+
+	if (configure_vnc_client(vnc, DRM_FORMAT_XRGB8888) < 0)
+		goto failure;
+
+	if (connect_vnc_client(vnc, address, port) < 0)
+		goto failure;
+
+	while (do_run)
+		run_main_loop_once();
+
+	rc = 0;
+failure:
+	vnc_client_stop_thread(vnc);
+	encoding_stats_destroy(encoding_stats);
+	headless_destroy(headless);
+headless_failure:
+	vnc_client_destroy(vnc);
+	return rc;
+}
+
+/* Decodes a recorded session as fast as possible with the same decoder
+ * options as a live session, and prints what each decoder spent.
+ */
+static int run_replay(const char* path)
+{
+	int rc = -1;
+
+	struct vnc_client* vnc = vnc_client_create();
+	if (!vnc)
+		return -1;
+
+	// Only used if the recording was made at a reduced depth
+	vnc_client_set_pixel_format(vnc, DRM_FORMAT_XRGB8888);
+
+	if (vnc_client_open_replay(vnc, path) < 0)
+		goto headless_failure;
+
+	if (decode_workers &&
+			vnc_client_set_decode_workers(vnc, decode_workers) < 0)
+		goto headless_failure;
+
+	vnc->use_thread = use_decode_thread;
+
+	// Nothing draws the planes, but they cost the same to decode
+	vnc->decode_jpeg_to_yuv = use_gpu_jpeg;
+
+	struct headless* headless = headless_create(vnc, false);
+	if (!headless)
+		goto headless_failure;
+
+	encoding_stats = encoding_stats_create(vnc, 0, NULL);
+	if (!encoding_stats)
+		goto failure;
+
+	if (vnc_client_init(vnc) < 0)
+		goto failure;
+
+	if (use_decode_thread) {
+		if (init_vnc_thread_handler(vnc) < 0)
+			goto failure;
+
+		while (do_run)
+			run_main_loop_once();
+
+		vnc_client_stop_thread(vnc);
+	} else {
+		while (vnc_client_process(vnc) == 0)
+			;
+	}
+
+	if (!vnc_client_is_replay_done(vnc)) {
+		fprintf(stderr, "Failed to decode %s\n", path);
+		goto failure;
+	}
+
+	encoding_stats_print_totals(encoding_stats, stdout);
+
+	rc = 0;
+failure:
+	vnc_client_stop_thread(vnc);
+	encoding_stats_destroy(encoding_stats);
+	headless_destroy(headless);
+headless_failure:
+	vnc_client_destroy(vnc);
+	return rc;
+}
+
 static int usage(int r)
 {
 	fprintf(r ? stderr : stdout, "\
@@ -1066,6 +1835,50 @@ Usage: wlvncc <address> [port]\n\
     -q,--quality             Quality level (0 - 9).\n\
     -t,--tls-cert            Use given TLS cert for authenticating server.\n\
     -s,--use-sw-renderer     Use software rendering.\n\
+    -T,--decode-thread       Decode on a separate thread.\n\
+    -W,--decode-workers=<n>  Number of threads that decode large updates\n\
+                             in parallel. Default: one per CPU, up to 8\n\
+    -Y,--gpu-jpeg            Convert JPEG from YUV to RGB on the GPU.\n\
+    -F,--direct-fb           Decode straight into the buffers that are\n\
+                             passed to the compositor. Implies -s.\n\
+    -B,--max-buffers=<n>     Maximum number of buffers to allocate while the\n\
+                             compositor is holding on to them (2 - 8).\n\
+                             Default: 4\n\
+    -P,--busy-policy=<name>  What to do with frames when no buffer is free:\n\
+                             drop: show them with the next frame.\n\
+                             coalesce: show them when a buffer is released.\n\
+                             Default: coalesce\n\
+    -f,--frame-pacing=<name> When to commit frames to the compositor:\n\
+                             none: as soon as they are rendered.\n\
+                             frame: when the compositor asks for one.\n\
+                             presentation: when the last one was shown.\n\
+                             Default: frame\n\
+    -C,--no-continuous-updates\n\
+                             Request each update instead of letting the\n\
+                             server stream them.\n\
+    -w,--request-window=<n>  Number of update requests to keep outstanding\n\
+                             when updates are requested (1 - 16). Default: 1\n\
+    -Q,--adaptive-quality    Adjust the quality level and the choice between\n\
+                             open-h264 and tight to the connection and the\n\
+                             decoding load. -q sets the starting level.\n\
+    -L,--low-bandwidth=<kbit/s>\n\
+                             Switch to 16 or 8 bits per pixel while the\n\
+                             connection is congested below this rate.\n\
+    -r,--record=<file>       Save the session so that it can be replayed.\n\
+    -R,--replay=<file>       Decode a saved session as fast as possible\n\
+                             without a window and print how long it took\n\
+                             and what each decoder spent. -T, -W and -Y\n\
+                             apply. No address is needed.\n\
+    -H,--headless            Decode without a window and print throughput\n\
+                             and latency every second.\n\
+    -S,--stats=<seconds>     Print what each decoder has been doing at this\n\
+                             interval.\n\
+    -U,--stats-socket=<path> Write decoder statistics since the start of the\n\
+                             session to anyone who connects to this socket.\n\
+    -l,--latency-stats=<seconds>\n\
+                             Print percentiles of the time from capture on\n\
+                             the server to presentation at this interval.\n\
+                             The server must send presentation timestamps.\n\
 \n\
 ");
 	return r;
@@ -1076,11 +1889,10 @@ int main(int argc, char* argv[])
 	int rc = -1;
 
 	enum pointer_cursor_type cursor_type = POINTER_CURSOR_LEFT_PTR;
-	const char* encodings = NULL;
-	int quality = -1;
-	int compression = -1;
-	static const char* shortopts = "a:A:q:c:e:hndist:";
+	static const char* shortopts = "a:A:q:c:e:hndist:TW:YFB:P:f:Cw:QL:r:R:HS:U:l:";
 	bool use_sw_renderer = false;
+	const char* replay_path = NULL;
+	bool headless = false;
 
 	static const struct option longopts[] = {
 		{ "app-id", required_argument, NULL, 'a' },
@@ -1094,6 +1906,23 @@ int main(int argc, char* argv[])
 		{ "quality", required_argument, NULL, 'q' },
 		{ "tls-cert", required_argument, NULL, 't' },
 		{ "use-sw-renderer", no_argument, NULL, 's' },
+		{ "decode-thread", no_argument, NULL, 'T' },
+		{ "decode-workers", required_argument, NULL, 'W' },
+		{ "gpu-jpeg", no_argument, NULL, 'Y' },
+		{ "direct-fb", no_argument, NULL, 'F' },
+		{ "max-buffers", required_argument, NULL, 'B' },
+		{ "busy-policy", required_argument, NULL, 'P' },
+		{ "frame-pacing", required_argument, NULL, 'f' },
+		{ "no-continuous-updates", no_argument, NULL, 'C' },
+		{ "request-window", required_argument, NULL, 'w' },
+		{ "adaptive-quality", no_argument, NULL, 'Q' },
+		{ "low-bandwidth", required_argument, NULL, 'L' },
+		{ "record", required_argument, NULL, 'r' },
+		{ "replay", required_argument, NULL, 'R' },
+		{ "headless", no_argument, NULL, 'H' },
+		{ "stats", required_argument, NULL, 'S' },
+		{ "stats-socket", required_argument, NULL, 'U' },
+		{ "latency-stats", required_argument, NULL, 'l' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -1133,6 +1962,83 @@ int main(int argc, char* argv[])
 		case 't':
 			tls_cert_path = optarg;
 			break;
+		case 'T':
+			use_decode_thread = true;
+			break;
+		case 'W':
+			decode_workers = atoi(optarg);
+			if (decode_workers < 1)
+				return usage(1);
+			break;
+		case 'Y':
+			use_gpu_jpeg = true;
+			break;
+		case 'F':
+			use_direct_fb = true;
+			use_sw_renderer = true;
+			break;
+		case 'B':
+			max_buffers = atoi(optarg);
+			if (max_buffers < WINDOW_MIN_BUFFERS ||
+					max_buffers > WINDOW_MAX_BUFFERS)
+				return usage(1);
+			break;
+		case 'P':
+			if (strcmp(optarg, "drop") == 0)
+				busy_policy = BUSY_POLICY_DROP;
+			else if (strcmp(optarg, "coalesce") == 0)
+				busy_policy = BUSY_POLICY_COALESCE;
+			else
+				return usage(1);
+			break;
+		case 'f':
+			if (strcmp(optarg, "none") == 0)
+				frame_pacing = FRAME_PACING_NONE;
+			else if (strcmp(optarg, "frame") == 0)
+				frame_pacing = FRAME_PACING_FRAME_CALLBACK;
+			else if (strcmp(optarg, "presentation") == 0)
+				frame_pacing = FRAME_PACING_PRESENTATION;
+			else
+				return usage(1);
+			break;
+		case 'C':
+			use_continuous_updates = false;
+			break;
+		case 'w':
+			request_window = atoi(optarg);
+			if (request_window < 1 || request_window > 16)
+				return usage(1);
+			break;
+		case 'Q':
+			use_adaptive_quality = true;
+			break;
+		case 'L':
+			low_bandwidth_threshold = atoi(optarg);
+			if (low_bandwidth_threshold <= 0)
+				return usage(1);
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'H':
+			headless = true;
+			break;
+		case 'S':
+			stats_period = atoi(optarg);
+			if (stats_period <= 0)
+				return usage(1);
+			break;
+		case 'U':
+			stats_socket_path = optarg;
+			break;
+		case 'l':
+			latency_stats_period = atoi(optarg);
+			if (latency_stats_period <= 0)
+				return usage(1);
+			break;
 		case 'h':
 			return usage(0);
 		default:
@@ -1140,12 +2046,18 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	// The decoders would write pixels that the compositor can't read
+	if (use_direct_fb && low_bandwidth_threshold) {
+		fprintf(stderr, "Low bandwidth mode won't work with direct frame buffers\n");
+		return 1;
+	}
+
 	int n_args = argc - optind;
 
-	if (n_args < 1)
+	if (n_args < 1 && !replay_path)
 		return usage(1);
 
-	const char* address = argv[optind];
+	const char* address = n_args >= 1 ? argv[optind] : NULL;
 	int port = 5900;
 	if (n_args >= 2)
 		port = atoi(argv[optind + 1]);
@@ -1159,6 +2071,16 @@ int main(int argc, char* argv[])
 	if (init_signal_handler() < 0)
 		goto signal_handler_failure;
 
+	if (replay_path) {
+		rc = run_replay(replay_path);
+		goto headless_done;
+	}
+
+	if (headless) {
+		rc = run_headless(address, port);
+		goto headless_done;
+	}
+
 	wl_display = wl_display_connect(NULL);
 	if (!wl_display) {
 		fprintf(stderr, "Failed to connect to local wayland display\n");
@@ -1201,12 +2123,28 @@ int main(int argc, char* argv[])
 
 	xdg_wm_base_add_listener(xdg_wm_base, &xdg_wm_base_listener, NULL);
 
+	if (frame_pacing == FRAME_PACING_PRESENTATION && !wp_presentation) {
+		fprintf(stderr, "Presentation time is not supported by the compositor. Falling back to frame callbacks.\n");
+		frame_pacing = FRAME_PACING_FRAME_CALLBACK;
+	}
+
 	if (!use_sw_renderer)
 		have_egl = init_egl_renderer() == 0;
 
 	wl_display_roundtrip(wl_display);
 	wl_display_roundtrip(wl_display);
 
+	// The presentation clock is known after the roundtrips
+	if (latency_stats_period && (!wp_presentation ||
+				presentation_clock != CLOCK_MONOTONIC)) {
+		fprintf(stderr, "Presentation time is not available. Latency won't be measured.\n");
+	} else if (latency_stats_period) {
+		latency_stats = latency_stats_create(wp_presentation,
+				latency_stats_period);
+		if (!latency_stats)
+			goto vnc_failure;
+	}
+
 	struct vnc_client* vnc = vnc_client_create();
 	if (!vnc)
 		goto vnc_failure;
@@ -1216,42 +2154,11 @@ int main(int argc, char* argv[])
 
 	uint32_t format = have_egl ? dmabuf_format : shm_format;
 
-	if (vnc_client_set_pixel_format(vnc, format) < 0) {
-		fprintf(stderr, "Unsupported pixel format\n");
+	if (configure_vnc_client(vnc, format) < 0)
 		goto vnc_setup_failure;
-	}
 
-	if (encodings) {
-		if (!have_egl && strstr(encodings, "open-h264")) {
-			fprintf(stderr, "Open H.264 encoding won't work without EGL\n");
-			goto vnc_setup_failure;
-		}
-	} else if (have_egl) {
-		encodings = "open-h264,tight,zrle,ultra,copyrect,hextile,zlib"
-			",corre,rre,raw";
-	} else {
-		encodings = "tight,zrle,ultra,copyrect,hextile,zlib,corre,rre,raw";
-	}
-	vnc_client_set_encodings(vnc, encodings);
-
-	if (quality >= 0)
-		vnc_client_set_quality_level(vnc, quality);
-
-	if (compression >= 0)
-		vnc_client_set_compression_level(vnc, compression);
-
-	if (vnc_client_connect(vnc, address, port) < 0) {
-		fprintf(stderr, "Failed to connect to server\n");
-		goto vnc_setup_failure;
-	}
-
-	if (init_vnc_client_handler(vnc) < 0)
-		goto vnc_setup_failure;
-
-	if (vnc_client_init(vnc) < 0) {
-		fprintf(stderr, "Failed to connect to server\n");
+	if (connect_vnc_client(vnc, address, port) < 0)
 		goto vnc_setup_failure;
-	}
 
 	pointers->userdata = vnc;
 	keyboards->userdata = vnc;
@@ -1264,9 +2171,11 @@ int main(int argc, char* argv[])
 		run_main_loop_once();
 
 	rc = 0;
+	vnc_client_stop_thread(vnc);
 	if (window)
 		window_destroy(window);
 vnc_setup_failure:
+	encoding_stats_destroy(encoding_stats);
 	vnc_client_destroy(vnc);
 vnc_failure:
 	output_list_destroy(&outputs);
@@ -1276,6 +2185,9 @@ vnc_failure:
 	xdg_wm_base_destroy(xdg_wm_base);
 	if (decoration_manager)
 		zxdg_decoration_manager_v1_destroy(decoration_manager);
+	latency_stats_destroy(latency_stats);
+	if (wp_presentation)
+		wp_presentation_destroy(wp_presentation);
 
 	egl_finish();
 	if (zwp_linux_dmabuf_v1)
@@ -1294,6 +2206,7 @@ pointer_failure:
 event_handler_failure:
 	wl_display_disconnect(wl_display);
 display_failure:
+headless_done:
 signal_handler_failure:
 	aml_unref(aml);
 	printf("Exiting...\n");
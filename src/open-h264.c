@@ -16,6 +16,7 @@
 
 #include "open-h264.h"
 #include "rfbclient.h"
+#include "usdt.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -289,8 +290,13 @@ struct AVFrame* open_h264_decode_rect(struct open_h264* self,
 
 		// If we get multiple frames per rect, there's no point in
 		// rendering them all, so we just return the last one.
-		if (packet->size != 0)
+		if (packet->size != 0) {
+			DTRACE_PROBE3(wlvncc, open_h264_decode_submit,
+					self->client, context, packet->size);
 			have_frame = decode_frame(context, frame, packet);
+			DTRACE_PROBE3(wlvncc, open_h264_decode_complete,
+					self->client, context, have_frame);
+		}
 	}
 
 failure:
@@ -90,6 +90,10 @@ bool drm_format_to_pixman_fmt(pixman_format_code_t* dst, uint32_t src)
 	X(R,G,B,,5,6,5,);
 	X(B,G,R,,5,6,5,);
 
+	/* 8 bits, where byte order does not matter */
+	case DRM_FORMAT_RGB332: *dst = PIXMAN_r3g3b2; break;
+	case DRM_FORMAT_BGR233: *dst = PIXMAN_b2g3r3; break;
+
 	/* These are incompatible on big endian */
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 	X(A,R,G,B,2,10,10,10);
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "quality-controller.h"
+#include "usdt.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define QC_PERIOD UINT64_C(1000000) // us
+#define QC_MIN_QUALITY 0
+#define QC_MAX_QUALITY 9
+
+// Share of wall time that may be spent decoding
+#define QC_CPU_BUDGET 0.5
+
+/* The link is taken to be congested when the round trip time is more than
+ * twice the lowest one seen, plus some slack for jitter.
+ */
+#define QC_ROUND_TRIP_SLACK UINT64_C(20000) // us
+
+// Good periods in a row before the quality is raised
+#define QC_PERIODS_BEFORE_RAISE 3
+// Good periods in a row at full quality before going back to tight
+#define QC_PERIODS_BEFORE_TIGHT 10
+// Good periods in a row before bits per pixel are raised
+#define QC_PERIODS_BEFORE_DEPTH 5
+
+/* Quality is not raised while the throughput is this close to where the
+ * link was last found to be congested.
+ */
+#define QC_THROUGHPUT_HEADROOM 0.8
+
+/* That limit is forgotten once the round trip time is back at the lowest
+ * one seen, or after this many good periods in a row, because the link may
+ * have more to give by then.
+ */
+#define QC_PERIODS_BEFORE_PROBE 10
+
+struct quality_controller {
+	struct quality_settings settings;
+	struct quality_controller_config config;
+
+	uint64_t period_start;
+	struct quality_sample sum;
+	uint64_t round_trip;
+	uint64_t min_round_trip;
+
+	double congested_throughput;
+	int n_good_periods;
+};
+
+struct quality_controller* quality_controller_create(
+		const struct quality_settings* initial,
+		const struct quality_controller_config* config)
+{
+	struct quality_controller* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->settings = *initial;
+	if (self->settings.quality < QC_MIN_QUALITY ||
+			self->settings.quality > QC_MAX_QUALITY)
+		self->settings.quality = 5;
+
+	self->config = *config;
+	self->settings.prefer_h264 &= config->can_use_h264;
+	self->min_round_trip = UINT64_MAX;
+
+	return self;
+}
+
+void quality_controller_destroy(struct quality_controller* self)
+{
+	free(self);
+}
+
+static bool quality_controller_lower(struct quality_controller* self,
+		bool is_cpu_bound)
+{
+	struct quality_settings* s = &self->settings;
+
+	// The hardware decoder takes the load off the CPU
+	if (is_cpu_bound && self->config.can_use_h264 && !s->prefer_h264) {
+		s->prefer_h264 = true;
+		return true;
+	}
+
+	if (s->quality > QC_MIN_QUALITY) {
+		s->quality--;
+		return true;
+	}
+
+	// H.264 needs less bandwidth than tight at its lowest quality
+	if (self->config.can_use_h264 && !s->prefer_h264) {
+		s->prefer_h264 = true;
+		return true;
+	}
+
+	return false;
+}
+
+static bool quality_controller_raise(struct quality_controller* self,
+		double throughput, double cpu_share)
+{
+	struct quality_settings* s = &self->settings;
+
+	if (self->congested_throughput > 0 && throughput >
+			self->congested_throughput * QC_THROUGHPUT_HEADROOM)
+		return false;
+
+	if (self->n_good_periods % QC_PERIODS_BEFORE_RAISE == 0 &&
+			s->quality < QC_MAX_QUALITY) {
+		s->quality++;
+		return true;
+	}
+
+	if (self->n_good_periods >= QC_PERIODS_BEFORE_TIGHT &&
+			s->prefer_h264 && cpu_share < QC_CPU_BUDGET / 4.0) {
+		s->prefer_h264 = false;
+		self->n_good_periods = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static bool quality_controller_lower_depth(struct quality_controller* self)
+{
+	struct quality_settings* s = &self->settings;
+
+	if (s->bits_per_pixel <= 8)
+		return false;
+
+	s->bits_per_pixel /= 2;
+	return true;
+}
+
+static bool quality_controller_raise_depth(struct quality_controller* self)
+{
+	struct quality_settings* s = &self->settings;
+
+	if (s->bits_per_pixel >= 32 ||
+			self->n_good_periods < QC_PERIODS_BEFORE_DEPTH)
+		return false;
+
+	s->bits_per_pixel *= 2;
+	self->n_good_periods = 0;
+	return true;
+}
+
+bool quality_controller_add_sample(struct quality_controller* self,
+		const struct quality_sample* sample, uint64_t now,
+		struct quality_settings* settings)
+{
+	if (self->period_start == 0)
+		self->period_start = now;
+
+	self->sum.bytes += sample->bytes;
+	self->sum.pixels += sample->pixels;
+	self->sum.decode_time += sample->decode_time;
+
+	if (sample->round_trip) {
+		self->round_trip = sample->round_trip;
+		if (sample->round_trip < self->min_round_trip)
+			self->min_round_trip = sample->round_trip;
+	}
+
+	uint64_t period = now - self->period_start;
+	if (period < QC_PERIOD)
+		return false;
+
+	struct quality_sample sum = self->sum;
+	self->sum = (struct quality_sample){ 0 };
+	self->period_start = now;
+
+	double throughput = (double)sum.bytes * 1e6 / (double)period;
+	double cpu_share = (double)sum.decode_time / (double)period;
+	double ns_per_pixel __attribute__((unused)) = sum.pixels ?
+		(double)sum.decode_time * 1e3 / (double)sum.pixels : 0;
+
+	DTRACE_PROBE6(wlvncc, quality_controller_period, (uint64_t)throughput,
+			(uint64_t)ns_per_pixel, self->round_trip,
+			self->settings.quality, self->settings.prefer_h264,
+			self->settings.bits_per_pixel);
+
+	bool is_congested = self->round_trip && self->round_trip >
+		2 * self->min_round_trip + QC_ROUND_TRIP_SLACK;
+	bool is_cpu_bound = cpu_share > QC_CPU_BUDGET;
+
+	bool changed = false;
+	if (is_congested || is_cpu_bound) {
+		self->n_good_periods = 0;
+		if (is_congested)
+			self->congested_throughput = throughput;
+		if (is_congested && throughput <
+				self->config.low_bandwidth_threshold)
+			changed = quality_controller_lower_depth(self);
+		if (!changed && self->config.adapt_quality)
+			changed = quality_controller_lower(self, is_cpu_bound);
+	} else if (sum.pixels != 0) {
+		// Nothing is learned from periods without updates
+		self->n_good_periods++;
+		if (self->n_good_periods >= QC_PERIODS_BEFORE_PROBE ||
+				(self->round_trip && self->round_trip <=
+				 self->min_round_trip + QC_ROUND_TRIP_SLACK))
+			self->congested_throughput = 0;
+		if (self->config.low_bandwidth_threshold)
+			changed = quality_controller_raise_depth(self);
+		if (!changed && self->config.adapt_quality)
+			changed = quality_controller_raise(self, throughput,
+					cpu_share);
+	}
+
+	if (changed)
+		*settings = self->settings;
+
+	return changed;
+}
@@ -18,6 +18,7 @@
 #include "renderer.h"
 #include "renderer-egl.h"
 #include "vnc.h"
+#include "usdt.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,6 +26,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <sys/stat.h>
 #include <gbm.h>
 #include <drm_fourcc.h>
 
@@ -49,9 +51,23 @@ X(PFNEGLDESTROYIMAGEKHRPROC, eglDestroyImageKHR) \
 X(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC, glEGLImageTargetTexture2DOES) \
 X(PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC, glEGLImageTargetRenderbufferStorageOES) \
 
+// Needed for staging uploads in pixel buffer objects
+#define GL_PBO_EXTENSION_LIST \
+X(PFNGLMAPBUFFERRANGEEXTPROC, glMapBufferRangeEXT) \
+X(PFNGLUNMAPBUFFEROESPROC, glUnmapBufferOES) \
+
+#define UPLOAD_RING_SIZE 3
+
+#define DAMAGE_MAX_BOXES 32
+#define DAMAGE_TILE_SIZE 64
+
+#define AV_FRAME_CACHE_SIZE 32
+#define AV_FRAME_CACHE_MAX_AGE 120
+
 #define X(t, n) static t n;
 	EGL_EXTENSION_LIST
 	GL_EXTENSION_LIST
+	GL_PBO_EXTENSION_LIST
 #undef X
 
 enum {
@@ -62,7 +78,51 @@ enum {
 struct fbo_info {
 	GLuint fbo;
 	GLuint rbo;
+	GLuint texture;
+	int width, height;
+};
+
+/* The decoder hands out a new file descriptor for each frame, even though
+ * the frames come from a small pool of surfaces, so the dmabufs are
+ * identified by their inodes instead.
+ */
+struct av_frame_cache_key {
 	int width, height;
+	EGLint colour_space, sample_range;
+	int n_planes;
+	dev_t dev[4];
+	ino_t ino[4];
+	uint32_t offset[4];
+	uint32_t pitch[4];
+	uint64_t modifier[4];
+};
+
+struct av_frame_cache_entry {
+	struct av_frame_cache_key key;
+	GLuint texture;
+	uint64_t last_used;
+};
+
+struct upload_rect {
+	int x, y, width, height;
+	size_t offset;
+};
+
+/* Damaged pixels are copied into the next buffer in the ring and the
+ * texture is updated from there, so that glTexSubImage2D() can return
+ * without waiting for the transfer. Each buffer is invalidated when it is
+ * mapped, so the driver does not have to wait for the GPU to finish reading
+ * it either.
+ */
+struct upload_ring {
+	GLuint pbos[UPLOAD_RING_SIZE];
+	size_t sizes[UPLOAD_RING_SIZE];
+	int next;
+	GLuint current;
+
+	struct upload_rect* rects;
+	int n_rects;
+	int rects_size;
 };
 
 static EGLDisplay egl_display = EGL_NO_DISPLAY;
@@ -70,7 +130,19 @@ static EGLContext egl_context = EGL_NO_CONTEXT;
 
 static GLuint shader_program = 0;
 static GLuint shader_program_ext = 0;
+static GLuint shader_program_yuv = 0;
+static GLuint shader_program_bgr233 = 0;
 static GLuint texture = 0;
+static uint32_t texture_format = 0;
+static int texture_width = 0;
+static int texture_height = 0;
+static GLuint texture_fbo = 0;
+static GLuint yuv_textures[3] = { 0 };
+static GLuint copy_texture = 0;
+static bool have_pbo = false;
+static struct upload_ring upload_ring = { 0 };
+static struct av_frame_cache_entry av_frame_cache[AV_FRAME_CACHE_SIZE];
+static uint64_t av_frame_cache_clock = 0;
 
 static const char *vertex_shader_src =
 "attribute vec2 pos;\n"
@@ -90,6 +162,35 @@ static const char *fragment_shader_src =
 "	gl_FragColor = vec4(colour.rgb, 1.0);\n"
 "}\n";
 
+// JFIF: full range BT.601
+static const char *fragment_shader_yuv_src =
+"precision mediump float;\n"
+"uniform sampler2D u_y;\n"
+"uniform sampler2D u_cb;\n"
+"uniform sampler2D u_cr;\n"
+"varying vec2 v_texture;\n"
+"void main() {\n"
+"	float y = texture2D(u_y, v_texture).r;\n"
+"	float cb = texture2D(u_cb, v_texture).r - 128.0 / 255.0;\n"
+"	float cr = texture2D(u_cr, v_texture).r - 128.0 / 255.0;\n"
+"	gl_FragColor = vec4(y + 1.402 * cr,\n"
+"			y - 0.344136 * cb - 0.714136 * cr,\n"
+"			y + 1.772 * cb, 1.0);\n"
+"}\n";
+
+// Each byte is bbgggrrr, uploaded as luminance
+static const char *fragment_shader_bgr233_src =
+"precision mediump float;\n"
+"uniform sampler2D u_tex;\n"
+"varying vec2 v_texture;\n"
+"void main() {\n"
+"	float v = floor(texture2D(u_tex, v_texture).r * 255.0 + 0.5);\n"
+"	float b = floor(v / 64.0);\n"
+"	float g = floor((v - b * 64.0) / 8.0);\n"
+"	float r = v - b * 64.0 - g * 8.0;\n"
+"	gl_FragColor = vec4(r / 7.0, g / 7.0, b / 3.0, 1.0);\n"
+"}\n";
+
 static const char *fragment_shader_ext_src =
 "#extension GL_OES_EGL_image_external: require\n\n"
 "precision mediump float;\n"
@@ -129,6 +230,32 @@ static int egl_load_gl_ext(void)
 	return 0;
 }
 
+static int egl_load_gl_pbo_ext(void)
+{
+#define X(t, n) \
+	n = (t)eglGetProcAddress(XSTR(n)); \
+	if (!n) \
+		return -1;
+
+	GL_PBO_EXTENSION_LIST
+#undef X
+
+	return 0;
+}
+
+static bool has_gl_extension(const char* name)
+{
+	const char* exts = (const char*)glGetString(GL_EXTENSIONS);
+	size_t len = strlen(name);
+
+	for (const char* s = exts; s && (s = strstr(s, name)); s += len)
+		if ((s == exts || s[-1] == ' ') &&
+				(s[len] == ' ' || s[len] == '\0'))
+			return true;
+
+	return false;
+}
+
 static int compile_shaders(const char* vert_src, const char* frag_src)
 {
 	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
@@ -202,10 +329,25 @@ int egl_init(struct gbm_device* gbm)
 	if (egl_load_gl_ext() < 0)
 		goto failure;
 
+	have_pbo = has_gl_extension("GL_NV_pixel_buffer_object") &&
+		has_gl_extension("GL_EXT_map_buffer_range") &&
+		has_gl_extension("GL_OES_mapbuffer") &&
+		egl_load_gl_pbo_ext() == 0;
+
 	shader_program = compile_shaders(vertex_shader_src,
 			fragment_shader_src);
 	shader_program_ext = compile_shaders(vertex_shader_src,
 			fragment_shader_ext_src);
+	shader_program_yuv = compile_shaders(vertex_shader_src,
+			fragment_shader_yuv_src);
+	shader_program_bgr233 = compile_shaders(vertex_shader_src,
+			fragment_shader_bgr233_src);
+
+	glUseProgram(shader_program_yuv);
+	glUniform1i(glGetUniformLocation(shader_program_yuv, "u_y"), 0);
+	glUniform1i(glGetUniformLocation(shader_program_yuv, "u_cb"), 1);
+	glUniform1i(glGetUniformLocation(shader_program_yuv, "u_cr"), 2);
+	glUseProgram(0);
 
 	return 0;
 
@@ -216,8 +358,24 @@ failure:
 
 void egl_finish(void)
 {
+	for (int i = 0; i < AV_FRAME_CACHE_SIZE; ++i)
+		if (av_frame_cache[i].texture)
+			glDeleteTextures(1, &av_frame_cache[i].texture);
+	if (upload_ring.pbos[0])
+		glDeleteBuffers(UPLOAD_RING_SIZE, upload_ring.pbos);
+	free(upload_ring.rects);
+	if (copy_texture)
+		glDeleteTextures(1, &copy_texture);
+	if (yuv_textures[0])
+		glDeleteTextures(3, yuv_textures);
+	if (texture_fbo)
+		glDeleteFramebuffers(1, &texture_fbo);
 	if (texture)
 		glDeleteTextures(1, &texture);
+	if (shader_program_yuv)
+		glDeleteProgram(shader_program_yuv);
+	if (shader_program_bgr233)
+		glDeleteProgram(shader_program_bgr233);
 	if (shader_program_ext)
 		glDeleteProgram(shader_program_ext);
 	if (shader_program)
@@ -292,8 +450,20 @@ static void fbo_from_gbm_bo(struct fbo_info* dst, struct gbm_bo* bo)
 
 	assert(status == GL_FRAMEBUFFER_COMPLETE);
 
+	// This is for copying between buffers
+	GLuint tex = 0;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
 	dst->fbo = fbo;
 	dst->rbo = rbo;
+	dst->texture = tex;
 	dst->width = width;
 	dst->height = height;
 
@@ -301,6 +471,32 @@ static void fbo_from_gbm_bo(struct fbo_info* dst, struct gbm_bo* bo)
 	close(fd);
 }
 
+/* The framebuffer objects live as long as the buffers, so that they are
+ * not re-created on every frame.
+ */
+static struct fbo_info* fbo_from_buffer(struct buffer* buffer)
+{
+	if (buffer->fbo)
+		return buffer->fbo;
+
+	buffer->fbo = calloc(1, sizeof(*buffer->fbo));
+	assert(buffer->fbo);
+
+	fbo_from_gbm_bo(buffer->fbo, buffer->bo);
+	return buffer->fbo;
+}
+
+void egl_fbo_destroy(struct fbo_info* fbo)
+{
+	if (!fbo)
+		return;
+
+	glDeleteFramebuffers(1, &fbo->fbo);
+	glDeleteRenderbuffers(1, &fbo->rbo);
+	glDeleteTextures(1, &fbo->texture);
+	free(fbo);
+}
+
 #define X(lc, uc) \
 static EGLint plane_ ## lc ## _key(int plane) \
 { \
@@ -399,6 +595,92 @@ static GLuint texture_from_av_frame(const struct AVFrame* frame)
 	return tex;
 }
 
+static int av_frame_cache_key_init(struct av_frame_cache_key* key,
+		const struct AVFrame* frame)
+{
+	// Padding is compared too
+	memset(key, 0, sizeof(*key));
+
+	AVDRMFrameDescriptor *desc = (void*)frame->data[0];
+	if (desc->nb_layers > 4)
+		return -1;
+
+	key->width = frame->width;
+	key->height = frame->height;
+	key->colour_space = get_color_space_hint(frame);
+	key->sample_range = frame->color_range;
+	key->n_planes = desc->nb_layers;
+
+	for (int i = 0; i < desc->nb_layers; ++i) {
+		const struct AVDRMPlaneDescriptor *plane =
+			&desc->layers[i].planes[0];
+		const struct AVDRMObjectDescriptor *obj =
+			&desc->objects[plane->object_index];
+
+		struct stat st;
+		if (fstat(obj->fd, &st) < 0)
+			return -1;
+
+		key->dev[i] = st.st_dev;
+		key->ino[i] = st.st_ino;
+		key->offset[i] = plane->offset;
+		key->pitch[i] = plane->pitch;
+		key->modifier[i] = obj->format_modifier;
+	}
+
+	return 0;
+}
+
+static void av_frame_cache_evict(struct av_frame_cache_entry* entry)
+{
+	glDeleteTextures(1, &entry->texture);
+	memset(entry, 0, sizeof(*entry));
+}
+
+/* Drops textures of surfaces that have not been seen in a while, e.g. after
+ * the decoder has been reset, so that their dmabufs can be released.
+ */
+static void av_frame_cache_expire(void)
+{
+	for (int i = 0; i < AV_FRAME_CACHE_SIZE; ++i) {
+		struct av_frame_cache_entry* entry = &av_frame_cache[i];
+		if (entry->texture && av_frame_cache_clock - entry->last_used >
+				AV_FRAME_CACHE_MAX_AGE)
+			av_frame_cache_evict(entry);
+	}
+}
+
+static GLuint av_frame_cache_get_texture(const struct AVFrame* frame)
+{
+	struct av_frame_cache_key key;
+	if (av_frame_cache_key_init(&key, frame) < 0)
+		return 0;
+
+	struct av_frame_cache_entry* lru = &av_frame_cache[0];
+
+	for (int i = 0; i < AV_FRAME_CACHE_SIZE; ++i) {
+		struct av_frame_cache_entry* entry = &av_frame_cache[i];
+
+		if (entry->texture && memcmp(&entry->key, &key,
+					sizeof(key)) == 0) {
+			entry->last_used = av_frame_cache_clock;
+			return entry->texture;
+		}
+
+		if (!entry->texture || (lru->texture &&
+					entry->last_used < lru->last_used))
+			lru = entry;
+	}
+
+	if (lru->texture)
+		av_frame_cache_evict(lru);
+
+	lru->key = key;
+	lru->texture = texture_from_av_frame(frame);
+	lru->last_used = av_frame_cache_clock;
+	return lru->texture;
+}
+
 void gl_draw(void)
 {
 	static const GLfloat s_vertices[4][2] = {
@@ -438,127 +720,656 @@ GLenum gl_format_from_drm(uint32_t format)
 	case DRM_FORMAT_ABGR8888:
 	case DRM_FORMAT_XBGR8888:
 		return GL_RGBA;
+	case DRM_FORMAT_RGB565:
+		return GL_RGB;
+	case DRM_FORMAT_BGR233:
+		return GL_LUMINANCE;
 	}
 
 	return 0;
 }
 
-void import_image_with_damage(const struct image* src,
-		struct pixman_region16* damage)
+static GLenum gl_type_from_drm(uint32_t format)
+{
+	return format == DRM_FORMAT_RGB565 ?
+		GL_UNSIGNED_SHORT_5_6_5 : GL_UNSIGNED_BYTE;
+}
+
+static int bytes_per_pixel_from_drm(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+		return 2;
+	case DRM_FORMAT_BGR233:
+		return 1;
+	}
+
+	return 4;
+}
+
+static GLuint shader_program_for_drm(uint32_t format)
+{
+	return format == DRM_FORMAT_BGR233 ?
+		shader_program_bgr233 : shader_program;
+}
+
+static void import_image_rect(const struct image* src, int x, int y,
+		int width, int height)
 {
 	GLenum fmt = gl_format_from_drm(src->format);
+	GLenum type = gl_type_from_drm(src->format);
+
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, fmt, type,
+			src->pixels);
+
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+}
+
+static int upload_ring_add_rect(int x, int y, int width, int height)
+{
+	struct upload_ring* ring = &upload_ring;
+
+	if (ring->n_rects == ring->rects_size) {
+		int size = ring->rects_size ? ring->rects_size * 2 : 64;
+		struct upload_rect* rects = realloc(ring->rects,
+				size * sizeof(*rects));
+		if (!rects)
+			return -1;
+
+		ring->rects = rects;
+		ring->rects_size = size;
+	}
 
+	struct upload_rect* rect = &ring->rects[ring->n_rects++];
+	rect->x = x;
+	rect->y = y;
+	rect->width = width;
+	rect->height = height;
+	return 0;
+}
+
+/* Copies the added rectangles into the next buffer in the ring. On failure,
+ * the rectangles must be imported directly from the image.
+ */
+static int upload_ring_stage(const struct image* src)
+{
+	struct upload_ring* ring = &upload_ring;
+
+	if (!ring->pbos[0])
+		glGenBuffers(UPLOAD_RING_SIZE, ring->pbos);
+
+	int bpp = bytes_per_pixel_from_drm(src->format);
+
+	size_t size = 0;
+	for (int i = 0; i < ring->n_rects; ++i) {
+		struct upload_rect* rect = &ring->rects[i];
+		rect->offset = size;
+		size += (size_t)rect->width * rect->height * bpp;
+	}
+
+	ring->current = 0;
+	if (size == 0)
+		return -1;
+
+	int index = ring->next;
+	ring->next = (ring->next + 1) % UPLOAD_RING_SIZE;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, ring->pbos[index]);
+
+	if (ring->sizes[index] < size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER_NV, size, NULL,
+				GL_STREAM_DRAW);
+		ring->sizes[index] = size;
+	}
+
+	uint8_t* dst = glMapBufferRangeEXT(GL_PIXEL_UNPACK_BUFFER_NV, 0, size,
+			GL_MAP_WRITE_BIT_EXT | GL_MAP_INVALIDATE_BUFFER_BIT_EXT);
+	if (!dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+		return -1;
+	}
+
+	for (int i = 0; i < ring->n_rects; ++i) {
+		const struct upload_rect* rect = &ring->rects[i];
+		const uint8_t* row = (const uint8_t*)src->pixels +
+			rect->y * src->stride + rect->x * bpp;
+		uint8_t* out = dst + rect->offset;
+		size_t row_size = rect->width * bpp;
+
+		for (int y = 0; y < rect->height; ++y) {
+			memcpy(out, row, row_size);
+			out += row_size;
+			row += src->stride;
+		}
+	}
+
+	bool ok = glUnmapBufferOES(GL_PIXEL_UNPACK_BUFFER_NV);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+
+	// The contents may be lost, e.g. due to a mode switch
+	if (!ok)
+		return -1;
+
+	ring->current = ring->pbos[index];
+	return 0;
+}
+
+/* Imports the rectangle from the staged buffer, if there is one, or else
+ * directly from the image.
+ */
+static void upload_ring_import_rect(const struct image* src,
+		const struct upload_rect* rect)
+{
+	GLuint pbo = upload_ring.current;
+
+	if (!pbo) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride /
+				bytes_per_pixel_from_drm(src->format));
+		import_image_rect(src, rect->x, rect->y, rect->width,
+				rect->height);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		return;
+	}
+
+	GLenum fmt = gl_format_from_drm(src->format);
+	GLenum type = gl_type_from_drm(src->format);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, pbo);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, rect->x, rect->y, rect->width,
+			rect->height, fmt, type, (const void*)rect->offset);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+}
+
+static void upload_ring_begin(void)
+{
+	upload_ring.n_rects = 0;
+	upload_ring.current = 0;
+}
+
+static void upload_ring_end(const struct image* src)
+{
+	if (!have_pbo || upload_ring_stage(src) < 0)
+		upload_ring.current = 0;
+}
+
+void import_image_with_damage(const struct image* src,
+		struct pixman_region16* damage)
+{
 	int n_rects = 0;
 	struct pixman_box16* rects =
 		pixman_region_rectangles(damage, &n_rects);
 
+	upload_ring_begin();
+
 	for (int i = 0; i < n_rects; ++i) {
 		int x = rects[i].x1;
 		int y = rects[i].y1;
 		int width = rects[i].x2 - x;
 		int height = rects[i].y2 - y;
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+		if (upload_ring_add_rect(x, y, width, height) < 0) {
+			// Out of memory; skip staging
+			upload_ring_begin();
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride /
+					bytes_per_pixel_from_drm(src->format));
+			for (int j = 0; j < n_rects; ++j)
+				import_image_rect(src, rects[j].x1, rects[j].y1,
+						rects[j].x2 - rects[j].x1,
+						rects[j].y2 - rects[j].y1);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+			return;
+		}
+	}
+
+	upload_ring_end(src);
+
+	for (int i = 0; i < upload_ring.n_rects; ++i)
+		upload_ring_import_rect(src, &upload_ring.rects[i]);
+}
+
+static GLuint create_texture(void)
+{
+	GLuint tex = 0;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return tex;
+}
 
-		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, fmt,
-				GL_UNSIGNED_BYTE, src->pixels);
+/* GLES2 only requires a few formats to be colour-renderable, so the texture
+ * may not be usable as a render target.
+ */
+static bool bind_texture_fbo(void)
+{
+	if (texture_fbo) {
+		glBindFramebuffer(GL_FRAMEBUFFER, texture_fbo);
+		return true;
 	}
 
-	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
-	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	glGenFramebuffers(1, &texture_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, texture_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, texture, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE)
+		return true;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &texture_fbo);
+	texture_fbo = 0;
+	return false;
+}
+
+bool egl_texture_is_renderable(uint32_t format)
+{
+	GLenum fmt = gl_format_from_drm(format);
+	GLenum type = gl_type_from_drm(format);
+	GLuint fbo = 0;
+
+	GLuint tex = create_texture();
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, fmt, 1, 1, 0, fmt, type, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, tex, 0);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &tex);
+
+	return status == GL_FRAMEBUFFER_COMPLETE;
 }
 
-void render_image_egl(struct buffer* dst, const struct image* src)
+static void render_yuv_frame(const struct vnc_render_op* op)
 {
-	struct fbo_info fbo;
-	fbo_from_gbm_bo(&fbo, dst->bo);
+	const struct vnc_yuv_frame* frame = &op->yuv;
+
+	// Failed to decode
+	if (!frame->planes[0])
+		return;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
+	if (!yuv_textures[0])
+		for (int i = 0; i < 3; ++i)
+			yuv_textures[i] = create_texture();
 
-	bool is_new_texture = !texture;
+	int widths[3] = { op->width, frame->chroma_width, frame->chroma_width };
+	int heights[3] = { op->height, frame->chroma_height,
+		frame->chroma_height };
 
-	if (!texture)
-		glGenTextures(1, &texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (int i = 0; i < 3; ++i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, yuv_textures[i]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, frame->strides[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, widths[i],
+				heights[i], 0, GL_LUMINANCE, GL_UNSIGNED_BYTE,
+				frame->planes[i]);
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	glUseProgram(shader_program_yuv);
+	glViewport(op->x, op->y, op->width, op->height);
+	gl_draw();
+
+	for (int i = 2; i >= 0; --i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+}
+
+static void render_copy(const struct vnc_render_op* op)
+{
+	if (!copy_texture)
+		copy_texture = create_texture();
+
+	// The source and destination may overlap, so go via another texture
+	glBindTexture(GL_TEXTURE_2D, copy_texture);
+	// RGB can be copied from both 32 and 16 bit textures
+	glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, op->src_x, op->src_y,
+			op->width, op->height, 0);
+
+	glUseProgram(shader_program);
+	glViewport(op->x, op->y, op->width, op->height);
+	gl_draw();
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/* Replays framebuffer changes onto the texture in the order in which they
+ * were received, because not all of them are in the source image. If the
+ * texture can't be drawn into, only the uploads are done and -1 is returned.
+ */
+static int apply_render_ops(const struct image* src,
+		const struct vnc_render_op* ops, int n_ops)
+{
+	bool is_staged = true;
+
+	upload_ring_begin();
+	for (int i = 0; i < n_ops && is_staged; ++i)
+		if (ops[i].type == VNC_RENDER_OP_UPLOAD)
+			is_staged = upload_ring_add_rect(ops[i].x, ops[i].y,
+					ops[i].width, ops[i].height) == 0;
+
+	if (is_staged)
+		upload_ring_end(src);
+	else
+		upload_ring_begin();
+
+	bool can_draw = bind_texture_fbo();
+
+	int upload_index = 0;
+	for (int i = 0; i < n_ops; ++i) {
+		const struct vnc_render_op* op = &ops[i];
+		struct upload_rect direct = {
+			op->x, op->y, op->width, op->height, 0
+		};
+
+		switch (op->type) {
+		case VNC_RENDER_OP_UPLOAD:
+			glBindTexture(GL_TEXTURE_2D, texture);
+			upload_ring_import_rect(src, is_staged ?
+					&upload_ring.rects[upload_index++] :
+					&direct);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			break;
+		case VNC_RENDER_OP_YUV:
+			if (can_draw)
+				render_yuv_frame(op);
+			break;
+		case VNC_RENDER_OP_COPY:
+			if (can_draw)
+				render_copy(op);
+			break;
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	for (int i = 0; i < n_ops && !can_draw; ++i)
+		if (ops[i].type != VNC_RENDER_OP_UPLOAD)
+			return -1;
+
+	return 0;
+}
+
+/* Returns the boxes to redraw for the damage region. If there are too many
+ * of them, they are snapped to a coarser grid, which merges neighbours,
+ * and as a last resort the extents are used. coarse must be initialised
+ * and it holds the boxes when they are merged.
+ */
+static struct pixman_box16* damage_get_boxes(struct pixman_region16* damage,
+		struct pixman_region16* coarse, int* n_boxes)
+{
+	int n = 0;
+	struct pixman_box16* boxes = pixman_region_rectangles(damage, &n);
+
+	if (n <= DAMAGE_MAX_BOXES) {
+		*n_boxes = n;
+		return boxes;
+	}
+
+	const int mask = DAMAGE_TILE_SIZE - 1;
+	for (int i = 0; i < n; ++i) {
+		int x1 = boxes[i].x1 & ~mask;
+		int y1 = boxes[i].y1 & ~mask;
+		int x2 = (boxes[i].x2 + mask) & ~mask;
+		int y2 = (boxes[i].y2 + mask) & ~mask;
+		pixman_region_union_rect(coarse, coarse, x1, y1, x2 - x1,
+				y2 - y1);
+	}
+
+	boxes = pixman_region_rectangles(coarse, &n);
+	if (n <= DAMAGE_MAX_BOXES) {
+		*n_boxes = n;
+		return boxes;
+	}
+
+	*n_boxes = 1;
+	return pixman_region_extents(damage);
+}
+
+static bool box_intersects(const struct pixman_box16* box, int x, int y,
+		int width, int height)
+{
+	return box->x1 < x + width && x < box->x2 &&
+		box->y1 < y + height && y < box->y2;
+}
+
+static void draw_damage(const struct pixman_box16* boxes, int n_boxes,
+		int x, int y, int width, int height)
+{
+	for (int i = 0; i < n_boxes; ++i) {
+		const struct pixman_box16* box = &boxes[i];
+		if (!box_intersects(box, x, y, width, height))
+			continue;
+
+		glScissor(box->x1, box->y1, box->x2 - box->x1,
+				box->y2 - box->y1);
+		gl_draw();
+	}
+}
+
+/* The texture is made anew when the frame buffer changes size or pixel
+ * format, along with the framebuffer object that is attached to it.
+ */
+static bool texture_needs_realloc(const struct image* src)
+{
+	return !texture || texture_format != src->format ||
+		texture_width != src->width || texture_height != src->height;
+}
+
+static void texture_realloc(const struct image* src)
+{
+	if (texture_fbo) {
+		glDeleteFramebuffers(1, &texture_fbo);
+		texture_fbo = 0;
+	}
+
+	if (texture)
+		glDeleteTextures(1, &texture);
+
+	glGenTextures(1, &texture);
+
+	texture_format = src->format;
+	texture_width = src->width;
+	texture_height = src->height;
+}
+
+int import_image_egl(const struct image* src,
+		const struct vnc_render_op* ops, int n_ops)
+{
+	int rc = 0;
+	bool is_new_texture = texture_needs_realloc(src);
+
+	if (is_new_texture)
+		texture_realloc(src);
 
 	glBindTexture(GL_TEXTURE_2D, texture);
 
+	// Packed pixels are unpacked by the shader, so they can't be filtered
+	GLint filter = src->format == DRM_FORMAT_BGR233 ?
+		GL_NEAREST : GL_LINEAR;
+
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
 
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride / 4);
+	// Rows of 16 and 8 bit pixels need not be 4 byte aligned
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
 	if (is_new_texture) {
 		GLenum fmt = gl_format_from_drm(src->format);
+		GLenum type = gl_type_from_drm(src->format);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, src->stride /
+				bytes_per_pixel_from_drm(src->format));
 		glTexImage2D(GL_TEXTURE_2D, 0, fmt, src->width, src->height, 0,
-				fmt, GL_UNSIGNED_BYTE, src->pixels);
-	} else {
+				fmt, type, src->pixels);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	} else if (n_ops == 0) {
 		import_image_with_damage(src,
 				(struct pixman_region16*)src->damage);
 	}
 
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	if (n_ops > 0)
+		rc = apply_render_ops(src, ops, n_ops);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return rc;
+}
+
+void draw_image_egl(struct buffer* dst, const struct image* src)
+{
+	struct fbo_info* fbo = fbo_from_buffer(dst);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo);
+
+	glBindTexture(GL_TEXTURE_2D, texture);
 
 	glViewport(0, 0, src->width, src->height);
 
-	glUseProgram(shader_program);
+	glUseProgram(shader_program_for_drm(src->format));
 
-	struct pixman_box16* ext = pixman_region_extents(&dst->damage);
-	glScissor(ext->x1, ext->y1, ext->x2 - ext->x1, ext->y2 - ext->y1);
-	glEnable(GL_SCISSOR_TEST);
+	struct pixman_region16 coarse;
+	pixman_region_init(&coarse);
 
-	gl_draw();
+	int n_boxes = 0;
+	struct pixman_box16* boxes = damage_get_boxes(&dst->damage, &coarse,
+			&n_boxes);
 
+	glEnable(GL_SCISSOR_TEST);
+	draw_damage(boxes, n_boxes, 0, 0, src->width, src->height);
 	glDisable(GL_SCISSOR_TEST);
 
+	pixman_region_fini(&coarse);
+
 	glFlush();
 
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	glDeleteFramebuffers(1, &fbo.fbo);
-	glDeleteRenderbuffers(1, &fbo.rbo);
-
 	pixman_region_clear(&dst->damage);
 }
 
+int render_image_egl(struct buffer* dst, const struct image* src,
+		const struct vnc_render_op* ops, int n_ops)
+{
+	DTRACE_PROBE3(wlvncc, render_image_egl_start, dst, dst->seq, n_ops);
+
+	int rc = import_image_egl(src, ops, n_ops);
+	draw_image_egl(dst, src);
+
+	/* The GPU may still be working on it */
+	DTRACE_PROBE2(wlvncc, render_image_egl_end, dst, dst->seq);
+	return rc;
+}
+
 void render_av_frames_egl(struct buffer* dst, struct vnc_av_frame** src,
 		int n_av_frames)
 {
-	struct fbo_info fbo;
-	fbo_from_gbm_bo(&fbo, dst->bo);
+	struct fbo_info* fbo = fbo_from_buffer(dst);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo);
+
+	struct pixman_region16 coarse;
+	pixman_region_init(&coarse);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fbo);
+	int n_boxes = 0;
+	struct pixman_box16* boxes = damage_get_boxes(&dst->damage, &coarse,
+			&n_boxes);
 
-	struct pixman_box16* ext = pixman_region_extents(&dst->damage);
-	glScissor(ext->x1, ext->y1, ext->x2 - ext->x1, ext->y2 - ext->y1);
 	glEnable(GL_SCISSOR_TEST);
 
 	glUseProgram(shader_program_ext);
 
+	av_frame_cache_clock++;
+
 	for (int i = 0; i < n_av_frames; ++i) {
 		const struct vnc_av_frame* frame = src[i];
 
 		glViewport(frame->x, frame->y, frame->width, frame->height);
 
-		GLuint tex = texture_from_av_frame(frame->frame);
+		GLuint tex = av_frame_cache_get_texture(frame->frame);
+		bool is_cached = tex != 0;
+		if (!is_cached)
+			tex = texture_from_av_frame(frame->frame);
+
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, tex);
 
-		gl_draw();
+		draw_damage(boxes, n_boxes, frame->x, frame->y, frame->width,
+				frame->height);
 
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+
+		if (!is_cached)
+			glDeleteTextures(1, &tex);
 	}
 
+	av_frame_cache_expire();
+
 	glDisable(GL_SCISSOR_TEST);
+	pixman_region_fini(&coarse);
 
 	glFlush();
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glDeleteFramebuffers(1, &fbo.fbo);
-	glDeleteRenderbuffers(1, &fbo.rbo);
 
 	pixman_region_clear(&dst->damage);
 }
+
+/* Copies a region from one buffer into another without going through the
+ * CPU.
+ */
+void egl_copy_buffer(struct buffer* dst, struct buffer* src,
+		struct pixman_region16* region)
+{
+	struct fbo_info* src_fbo = fbo_from_buffer(src);
+	struct fbo_info* dst_fbo = fbo_from_buffer(dst);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, dst_fbo->fbo);
+	glBindTexture(GL_TEXTURE_2D, src_fbo->texture);
+
+	glViewport(0, 0, src->width, src->height);
+
+	glUseProgram(shader_program);
+
+	struct pixman_region16 coarse;
+	pixman_region_init(&coarse);
+
+	int n_boxes = 0;
+	struct pixman_box16* boxes = damage_get_boxes(region, &coarse,
+			&n_boxes);
+
+	glEnable(GL_SCISSOR_TEST);
+	draw_damage(boxes, n_boxes, 0, 0, src->width, src->height);
+	glDisable(GL_SCISSOR_TEST);
+
+	pixman_region_fini(&coarse);
+
+	glFlush();
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
@@ -17,6 +17,7 @@
 #include "renderer.h"
 #include "buffer.h"
 #include "pixels.h"
+#include "usdt.h"
 
 #include <stdbool.h>
 #include <unistd.h>
@@ -28,6 +29,8 @@ void render_image(struct buffer* dst, const struct image* src)
 {
 	bool ok __attribute__((unused));
 
+	DTRACE_PROBE2(wlvncc, render_image_start, dst, dst->seq);
+
 	pixman_format_code_t dst_fmt = 0;
 	ok = drm_format_to_pixman_fmt(&dst_fmt, dst->format);
 	assert(ok);
@@ -54,5 +57,7 @@ void render_image(struct buffer* dst, const struct image* src)
 	pixman_image_unref(dstimg);
 
 	pixman_region_clear(&dst->damage);
+
+	DTRACE_PROBE2(wlvncc, render_image_end, dst, dst->seq);
 }
 
@@ -57,6 +57,9 @@
 #include "minilzo.h"
 #endif
 #include "tls.h"
+#include "worker-pool.h"
+#include "time-util.h"
+#include "usdt.h"
 
 #define MAX_TEXTCHAT_SIZE 10485760 /* 10MB */
 
@@ -179,6 +182,8 @@ static rfbBool HandleZRLE24Down(rfbClient* client, int rx, int ry, int rw,
 static rfbBool HandleZRLE32(rfbClient* client, int rx, int ry, int rw, int rh);
 #endif
 
+static rfbBool FlushPendingJpegRects(rfbClient* client);
+
 /*
  * Server Capability Functions
  */
@@ -1234,6 +1239,18 @@ rfbBool InitialiseRFBConnection(rfbClient* client)
 	return TRUE;
 }
 
+static void MakeSetPixelFormatMsg(rfbClient* client, rfbSetPixelFormatMsg* spf,
+                                  const rfbPixelFormat* format)
+{
+	spf->type = rfbSetPixelFormat;
+	spf->pad1 = 0;
+	spf->pad2 = 0;
+	spf->format = *format;
+	spf->format.redMax = rfbClientSwap16IfLE(spf->format.redMax);
+	spf->format.greenMax = rfbClientSwap16IfLE(spf->format.greenMax);
+	spf->format.blueMax = rfbClientSwap16IfLE(spf->format.blueMax);
+}
+
 /*
  * SetFormatAndEncodings.
  */
@@ -1258,13 +1275,11 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 	if (!SupportsClient2Server(client, rfbSetPixelFormat))
 		return TRUE;
 
-	spf.type = rfbSetPixelFormat;
-	spf.pad1 = 0;
-	spf.pad2 = 0;
-	spf.format = client->format;
-	spf.format.redMax = rfbClientSwap16IfLE(spf.format.redMax);
-	spf.format.greenMax = rfbClientSwap16IfLE(spf.format.greenMax);
-	spf.format.blueMax = rfbClientSwap16IfLE(spf.format.blueMax);
+	/* Sending the current format would undo a change that is on its way */
+	MakeSetPixelFormatMsg(client, &spf,
+	                      client->pixelFormatChangesInFlight ?
+	                              &client->requestedFormat :
+	                              &client->format);
 
 	if (!WriteToRFBServer(client, (char*)&spf, sz_rfbSetPixelFormatMsg))
 		return FALSE;
@@ -1417,6 +1432,14 @@ rfbBool SetFormatAndEncodings(rfbClient* client)
 		encs[se->nEncodings++] =
 		        rfbClientSwap32IfLE(rfbEncodingQemuExtendedKeyEvent);
 
+	/* Pipelining */
+	if (se->nEncodings < MAX_ENCODINGS)
+		encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingFence);
+	if (se->nEncodings < MAX_ENCODINGS &&
+	    client->appData.enableContinuousUpdates)
+		encs[se->nEncodings++] =
+		        rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+
 	/* pts */
 	if (se->nEncodings < MAX_ENCODINGS)
 		encs[se->nEncodings++] = rfbClientSwap32IfLE(-1000);
@@ -1439,6 +1462,31 @@ rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client)
 	        client->updateRect.w, client->updateRect.h, TRUE);
 }
 
+/*
+ * FillUpdateRequestWindow - keeps appData.updateRequestWindow requests
+ * outstanding, so that the server has one to answer while the client is
+ * still decoding the last update and the round trip is hidden.
+ */
+
+static rfbBool FillUpdateRequestWindow(rfbClient* client)
+{
+	int n = client->appData.updateRequestWindow -
+	        client->pendingUpdateRequests;
+	int i;
+
+	/* Servers that merge requests answer several of them with one update,
+	 * so the count is only an upper bound. Sending at least one request per
+	 * update makes sure that the client never stalls. */
+	if (n < 1)
+		n = 1;
+
+	for (i = 0; i < n; i++)
+		if (!SendIncrementalFramebufferUpdateRequest(client))
+			return FALSE;
+
+	return TRUE;
+}
+
 /*
  * SendFramebufferUpdateRequest.
  */
@@ -1467,6 +1515,175 @@ rfbBool SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w,
 	                      sz_rfbFramebufferUpdateRequestMsg))
 		return FALSE;
 
+	client->pendingUpdateRequests++;
+	client->updateRequestsSent++;
+	return TRUE;
+}
+
+/*
+ * SendEnableContinuousUpdates.
+ */
+
+rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable, int x,
+                                    int y, int w, int h)
+{
+	rfbEnableContinuousUpdatesMsg ecu;
+
+	if (!SupportsClient2Server(client, rfbEnableContinuousUpdates))
+		return TRUE;
+
+	ecu.type = rfbEnableContinuousUpdates;
+	ecu.enable = enable ? 1 : 0;
+	ecu.x = rfbClientSwap16IfLE(x);
+	ecu.y = rfbClientSwap16IfLE(y);
+	ecu.w = rfbClientSwap16IfLE(w);
+	ecu.h = rfbClientSwap16IfLE(h);
+
+	if (!WriteToRFBServer(client, (char*)&ecu,
+	                      sz_rfbEnableContinuousUpdatesMsg))
+		return FALSE;
+
+	client->continuousUpdatesEnabled = enable;
+	return TRUE;
+}
+
+/*
+ * SendFence.
+ */
+
+rfbBool SendFence(rfbClient* client, uint32_t flags, unsigned int length,
+                  const char* data)
+{
+	char buf[sz_rfbFenceMsg + rfbFenceMaxDataLength];
+	rfbFenceMsg fence;
+
+	if (!SupportsClient2Server(client, rfbFence))
+		return TRUE;
+
+	if (length > rfbFenceMaxDataLength)
+		return FALSE;
+
+	memset(&fence, 0, sizeof(fence));
+	fence.type = rfbFence;
+	fence.flags = rfbClientSwap32IfLE(flags);
+	fence.length = length;
+
+	/* The header and the data go out in one write, so that they are not
+	 * interleaved with messages from other threads */
+	memcpy(buf, &fence, sz_rfbFenceMsg);
+	memcpy(buf + sz_rfbFenceMsg, data, length);
+
+	return WriteToRFBServer(client, buf, sz_rfbFenceMsg + length);
+}
+
+/*
+ * SendRoundTripFence - the server answers it after it has processed
+ * everything that was sent before, so the time until the answer arrives is
+ * the round trip time as seen by the protocol.
+ */
+
+static rfbBool SendRoundTripFence(rfbClient* client)
+{
+	uint64_t now = gettime_us();
+
+	if (!SendFence(client, rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+	               sizeof(now), (const char*)&now))
+		return FALSE;
+
+	client->fenceSentTime = now;
+	return TRUE;
+}
+
+/*
+ * SendPixelFormatChange - the fence carries the new pixel format and asks the
+ * server to act on the SetPixelFormat message that follows it right after it
+ * has answered. Everything that arrives before the answer is in the old
+ * format and everything after it is in the new one.
+ */
+
+rfbBool SendPixelFormatChange(rfbClient* client, const rfbPixelFormat* format)
+{
+	char buf[sz_rfbFenceMsg + sz_rfbPixelFormat + sz_rfbSetPixelFormatMsg];
+	rfbSetPixelFormatMsg spf;
+	rfbFenceMsg fence;
+
+	if (!client->fenceSupported) {
+		rfbClientLog("Can't change pixel format without fences\n");
+		return TRUE;
+	}
+
+	if (!SupportsClient2Server(client, rfbSetPixelFormat))
+		return TRUE;
+
+	MakeSetPixelFormatMsg(client, &spf, format);
+
+	memset(&fence, 0, sizeof(fence));
+	fence.type = rfbFence;
+	fence.flags = rfbClientSwap32IfLE(rfbFenceFlagRequest |
+	                                  rfbFenceFlagSyncNext);
+	fence.length = sz_rfbPixelFormat;
+
+	/* Nothing may come between the fence and the pixel format, so they
+	 * go out in one write */
+	memcpy(buf, &fence, sz_rfbFenceMsg);
+	memcpy(buf + sz_rfbFenceMsg, &spf.format, sz_rfbPixelFormat);
+	memcpy(buf + sz_rfbFenceMsg + sz_rfbPixelFormat, &spf,
+	       sz_rfbSetPixelFormatMsg);
+
+	if (!WriteToRFBServer(client, buf, sizeof(buf)))
+		return FALSE;
+
+	client->requestedFormat = *format;
+	client->pixelFormatChangesInFlight++;
+	return TRUE;
+}
+
+static rfbBool HandlePixelFormatChange(rfbClient* client, uint32_t flags,
+                                       const char* data)
+{
+	rfbPixelFormat format;
+
+	if (!(flags & rfbFenceFlagSyncNext))
+		rfbClientLog("Server does not sync fences; pixel format may "
+		             "have changed early\n");
+
+	memcpy(&format, data, sz_rfbPixelFormat);
+	format.redMax = rfbClientSwap16IfLE(format.redMax);
+	format.greenMax = rfbClientSwap16IfLE(format.greenMax);
+	format.blueMax = rfbClientSwap16IfLE(format.blueMax);
+
+	if (client->pixelFormatChangesInFlight > 0)
+		client->pixelFormatChangesInFlight--;
+
+	rfbClientLog("Switching to %d bits per pixel\n",
+	             (int)format.bitsPerPixel);
+
+	client->format = format;
+	if (!client->MallocFrameBuffer(client))
+		return FALSE;
+
+	/* What was in the frame buffer is gone */
+	return SendFramebufferUpdateRequest(client, 0, 0, client->width,
+	                                    client->height, FALSE);
+}
+
+static rfbBool HandleFenceResponse(rfbClient* client, uint32_t flags,
+                                   unsigned int length, const char* data)
+{
+	uint64_t sent;
+
+	if (length == sz_rfbPixelFormat)
+		return HandlePixelFormatChange(client, flags, data);
+
+	if (length != sizeof(sent) || client->fenceSentTime == 0)
+		return TRUE;
+
+	memcpy(&sent, data, sizeof(sent));
+	if (sent != client->fenceSentTime)
+		return TRUE;
+
+	client->fenceRoundTrip = gettime_us() - sent;
+	client->fenceSentTime = 0;
 	return TRUE;
 }
 
@@ -1654,7 +1871,17 @@ static rfbBool ResizeClientBuffer(rfbClient* client, int width, int height)
 	client->updateRect.x = client->updateRect.y = 0;
 	client->updateRect.w = client->width;
 	client->updateRect.h = client->height;
-	return client->MallocFrameBuffer(client);
+	if (!client->MallocFrameBuffer(client))
+		return FALSE;
+
+	/* Continuous updates are only sent for the area that was given when
+	 * they were enabled */
+	if (client->continuousUpdatesEnabled)
+		return SendEnableContinuousUpdates(client, TRUE, 0, 0,
+		                                   client->width,
+		                                   client->height);
+
+	return TRUE;
 }
 
 /*
@@ -1765,6 +1992,104 @@ rfbBool SendClientCutText(rfbClient* client, char* str, int len)
 	        WriteToRFBServer(client, str, len));
 }
 
+/*
+ * Decoding statistics.
+ */
+
+static uint64_t StatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int StatsEncoding(rfbClient* client, uint32_t encoding)
+{
+	switch (encoding) {
+	case rfbEncodingRaw:
+		return rfbStatsRaw;
+	case rfbEncodingCopyRect:
+		return rfbStatsCopyRect;
+	case rfbEncodingRRE:
+		return rfbStatsRRE;
+	case rfbEncodingCoRRE:
+		return rfbStatsCoRRE;
+	case rfbEncodingHextile:
+		return rfbStatsHextile;
+	case rfbEncodingZlib:
+		return rfbStatsZlib;
+	case rfbEncodingTight:
+		return client->tightRectIsJpeg ? rfbStatsTightJpeg
+		                               : rfbStatsTightBasic;
+	case rfbEncodingZRLE:
+	case rfbEncodingZYWRLE:
+		return rfbStatsZRLE;
+	case rfbEncodingTRLE:
+		return rfbStatsTRLE;
+	case rfbEncodingUltra:
+	case rfbEncodingUltraZip:
+		return rfbStatsUltra;
+	case rfbEncodingOpenH264:
+		return rfbStatsOpenH264;
+	}
+
+	return -1;
+}
+
+static int StatsBucket(uint64_t value)
+{
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+	return bucket < RFB_STATS_HISTOGRAM_SIZE ? bucket
+	                                         : RFB_STATS_HISTOGRAM_SIZE - 1;
+}
+
+static uint64_t StatsBytesConsumed(rfbClient* client)
+{
+	return client->bytesReceived - client->buffered;
+}
+
+/*
+ * Accounts for a rectangle that started decoding at startTime. Time spent
+ * waiting for the server and decoding batched JPEG rectangles along the way
+ * is not counted; the latter is accounted for by the batch.
+ */
+static void RecordRectStats(rfbClient* client,
+                            const rfbFramebufferUpdateRectHeader* rect,
+                            uint64_t startTime, uint64_t startWait,
+                            uint64_t startBatch, uint64_t startBytes)
+{
+	int encoding = StatsEncoding(client, rect->encoding);
+	if (encoding < 0)
+		return;
+
+	uint64_t elapsed = StatsNow() - startTime;
+	uint64_t excluded = (client->waitTime - startWait) * 1000 +
+	                    client->jpegBatchTime - startBatch;
+	uint64_t decodeTime = elapsed > excluded ? elapsed - excluded : 0;
+
+	rfbEncodingStats* stats = &client->encodingStats[encoding];
+	stats->rects++;
+	stats->bytes += StatsBytesConsumed(client) - startBytes;
+	stats->pixels += (uint64_t)rect->r.w * rect->r.h;
+	stats->decodeTime += decodeTime;
+	stats->decodeTimeHistogram[StatsBucket(decodeTime)]++;
+	stats->updateRects++;
+}
+
+static void RecordUpdateStats(rfbClient* client)
+{
+	int i;
+
+	for (i = 0; i < rfbStatsEncodingCount; i++) {
+		rfbEncodingStats* stats = &client->encodingStats[i];
+		if (stats->updateRects == 0)
+			continue;
+
+		stats->rectsPerUpdateHistogram[StatsBucket(stats->updateRects)]++;
+		stats->updateRects = 0;
+	}
+}
+
 static rfbBool HandleFramebufferUpdate(rfbClient* client,
                                        rfbServerToClientMsg* msg)
 {
@@ -1772,6 +2097,7 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 	int linesToRead;
 	int bytesPerLine;
 	int i;
+	uint64_t statsStart, statsWait, statsBatch, statsBytes;
 
 	if (client->StartingFrameBufferUpdate)
 		client->StartingFrameBufferUpdate(client);
@@ -1782,6 +2108,11 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 
 	msg->fu.nRects = rfbClientSwap16IfLE(msg->fu.nRects);
 
+	/* Continuous updates are not requested */
+	if (client->pendingUpdateRequests > 0)
+		client->pendingUpdateRequests--;
+	client->updatesReceived++;
+
 	for (i = 0; i < msg->fu.nRects; i++) {
 		if (!ReadFromRFBServer(client, (char*)&rect,
 		                       sz_rfbFramebufferUpdateRectHeader))
@@ -1796,6 +2127,12 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 		rect.r.w = rfbClientSwap16IfLE(rect.r.w);
 		rect.r.h = rfbClientSwap16IfLE(rect.r.h);
 
+		/* Only other Tight rectangles know whether they need pending JPEG
+		 * rectangles to be decoded first */
+		if (rect.encoding != rfbEncodingTight &&
+		    !FlushPendingJpegRects(client))
+			goto failure;
+
 		if (rect.encoding == rfbEncodingXCursor ||
 		    rect.encoding == rfbEncodingRichCursor) {
 
@@ -1997,6 +2334,14 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 			                           rect.r.w, rect.r.h);
 		}
 
+		statsStart = StatsNow();
+		statsWait = client->waitTime;
+		statsBatch = client->jpegBatchTime;
+		statsBytes = StatsBytesConsumed(client);
+
+		DTRACE_PROBE6(wlvncc, rect_start, client, rect.encoding,
+		              rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+
 		switch (rect.encoding) {
 
 		case rfbEncodingRaw: {
@@ -2345,9 +2690,28 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 
 		client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y,
 		                             rect.r.w, rect.r.h);
+
+		RecordRectStats(client, &rect, statsStart, statsWait,
+		                statsBatch, statsBytes);
+
+		DTRACE_PROBE4(wlvncc, rect_end, client, rect.encoding,
+		              StatsEncoding(client, rect.encoding),
+		              StatsBytesConsumed(client) - statsBytes);
 	}
 
-	if (!SendIncrementalFramebufferUpdateRequest(client))
+	if (!FlushPendingJpegRects(client))
+		goto failure;
+
+	RecordUpdateStats(client);
+
+	/* With continuous updates, the server sends the next update without
+	 * being asked */
+	if (!client->continuousUpdatesEnabled &&
+	    !FillUpdateRequestWindow(client))
+		goto failure;
+
+	if (client->fenceSupported && client->fenceSentTime == 0 &&
+	    !SendRoundTripFence(client))
 		goto failure;
 
 	if (client->FinishedFrameBufferUpdate)
@@ -2356,6 +2720,8 @@ static rfbBool HandleFramebufferUpdate(rfbClient* client,
 	return TRUE;
 
 failure:
+	FlushPendingJpegRects(client);
+
 	if (client->CancelledFrameBufferUpdate)
 		client->CancelledFrameBufferUpdate(client);
 
@@ -2495,6 +2861,79 @@ rfbBool HandleRFBServerMessage(rfbClient* client)
 		break;
 	}
 
+	case rfbEndOfContinuousUpdates: {
+		/* The first one only announces that the server supports it */
+		if (!client->continuousUpdatesSupported) {
+			client->continuousUpdatesSupported = TRUE;
+			SetClient2Server(client, rfbEnableContinuousUpdates);
+			SetServer2Client(client, rfbEndOfContinuousUpdates);
+
+			if (!client->appData.enableContinuousUpdates)
+				break;
+
+			rfbClientLog("Enabling continuous updates\n");
+			if (!SendEnableContinuousUpdates(
+			            client, TRUE, client->updateRect.x,
+			            client->updateRect.y, client->updateRect.w,
+			            client->updateRect.h))
+				return FALSE;
+			break;
+		}
+
+		if (!client->continuousUpdatesEnabled)
+			break;
+
+		/* The server has stopped sending updates on its own */
+		rfbClientLog("Continuous updates ended by server\n");
+		client->continuousUpdatesEnabled = FALSE;
+		if (!FillUpdateRequestWindow(client))
+			return FALSE;
+		break;
+	}
+
+	case rfbFence: {
+		char data[rfbFenceMaxDataLength];
+
+		if (!ReadFromRFBServer(client, ((char*)&msg) + 1,
+		                       sz_rfbFenceMsg - 1))
+			return FALSE;
+
+		msg.fence.flags = rfbClientSwap32IfLE(msg.fence.flags);
+
+		if (msg.fence.length > rfbFenceMaxDataLength) {
+			rfbClientErr("Fence data too long: %u B\n",
+			             (unsigned int)msg.fence.length);
+			return FALSE;
+		}
+
+		if (msg.fence.length > 0 &&
+		    !ReadFromRFBServer(client, data, msg.fence.length))
+			return FALSE;
+
+		if (!client->fenceSupported) {
+			client->fenceSupported = TRUE;
+			SetClient2Server(client, rfbFence);
+			SetServer2Client(client, rfbFence);
+		}
+
+		if (!(msg.fence.flags & rfbFenceFlagRequest)) {
+			if (!HandleFenceResponse(client, msg.fence.flags,
+			                         msg.fence.length, data))
+				return FALSE;
+			break;
+		}
+
+		/* Messages are handled in order, so blocking before and
+		 * after is already taken care of. SyncNext is not
+		 * supported, which the answer tells the server. */
+		if (!SendFence(client,
+		               msg.fence.flags & (rfbFenceFlagBlockBefore |
+		                                  rfbFenceFlagBlockAfter),
+		               msg.fence.length, data))
+			return FALSE;
+		break;
+	}
+
 	case rfbXvp: {
 		if (!ReadFromRFBServer(client, ((char*)&msg) + 1,
 		                       sz_rfbXvpMsg - 1))
@@ -2589,6 +3028,166 @@ rfbBool HandleRFBServerMessage(rfbClient* client)
 #define CONCAT3(a, b, c) a##b##c
 #define CONCAT3E(a, b, c) CONCAT3(a, b, c)
 
+/*
+ * Tight JPEG rectangles are independent of each other. When a worker pool is
+ * available, their compressed data is collected while the update is being
+ * read and they are decoded in parallel, each worker with its own TurboJPEG
+ * handle. Pending rectangles are flushed before anything else may touch
+ * their pixels, and always before the update is finished.
+ */
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+
+#include "turbojpeg.h"
+
+struct _rfbPendingJpegRect {
+	uint8_t* data;
+	int length;
+	int x, y, w, h;
+	int flags;
+	rfbBool ok;
+};
+
+static void DecodePendingJpegRect(void* userdata, int job, int worker)
+{
+	rfbClient* client = userdata;
+	struct _rfbPendingJpegRect* rect = &client->pendingJpegRects[job];
+	int pixelSize = client->format.bitsPerPixel / 8;
+	int pitch = client->width * pixelSize;
+	uint8_t* dst = &client->frameBuffer[rect->y * pitch + rect->x * pixelSize];
+
+	rect->ok = FALSE;
+
+	if (!client->workerTjhnds[worker]) {
+		client->workerTjhnds[worker] = tjInitDecompress();
+		if (!client->workerTjhnds[worker]) {
+			rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+			return;
+		}
+	}
+
+	if (tjDecompress(client->workerTjhnds[worker], rect->data,
+	                 (unsigned long)rect->length, dst, rect->w, pitch,
+	                 rect->h, pixelSize, rect->flags) == -1) {
+		rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+		return;
+	}
+
+	rect->ok = TRUE;
+}
+
+static rfbBool FlushPendingJpegRects(rfbClient* client)
+{
+	rfbBool ok = TRUE;
+	int i;
+
+	if (client->pendingJpegRectsCount == 0)
+		return TRUE;
+
+	uint64_t start = StatsNow();
+
+	worker_pool_run(client->workerPool, DecodePendingJpegRect, client,
+	                client->pendingJpegRectsCount);
+
+	uint64_t elapsed = StatsNow() - start;
+	client->encodingStats[rfbStatsTightJpeg].decodeTime += elapsed;
+	client->jpegBatchTime += elapsed;
+
+	for (i = 0; i < client->pendingJpegRectsCount; i++) {
+		if (!client->pendingJpegRects[i].ok)
+			ok = FALSE;
+		free(client->pendingJpegRects[i].data);
+	}
+
+	client->pendingJpegRectsCount = 0;
+	return ok;
+}
+
+/* A batch may still be pending if the connection was lost mid update */
+void FreePendingJpegRects(rfbClient* client)
+{
+	int i;
+
+	for (i = 0; i < client->pendingJpegRectsCount; i++)
+		free(client->pendingJpegRects[i].data);
+
+	free(client->pendingJpegRects);
+	client->pendingJpegRects = NULL;
+	client->pendingJpegRectsCount = 0;
+	client->pendingJpegRectsSize = 0;
+}
+
+static rfbBool JpegRectsOverlap(const struct _rfbPendingJpegRect* r, int x,
+                                int y, int w, int h)
+{
+	return x < r->x + r->w && r->x < x + w && y < r->y + r->h &&
+	       r->y < y + h;
+}
+
+/*
+ * Queues a JPEG rectangle for decoding on the worker pool. Takes ownership
+ * of data, whether it succeeds or not.
+ */
+static rfbBool QueueJpegRect(rfbClient* client, uint8_t* data, int length,
+                             int x, int y, int w, int h, int flags)
+{
+	struct _rfbPendingJpegRect* rect;
+	int i;
+
+	if (!client->workerTjhnds) {
+		int n = worker_pool_get_n_workers(client->workerPool);
+		client->workerTjhnds = calloc(n, sizeof(*client->workerTjhnds));
+		if (!client->workerTjhnds)
+			goto failure;
+		client->workerTjhndsCount = n;
+	}
+
+	for (i = 0; i < client->pendingJpegRectsCount; i++)
+		if (JpegRectsOverlap(&client->pendingJpegRects[i], x, y, w, h)) {
+			if (!FlushPendingJpegRects(client))
+				goto failure;
+			break;
+		}
+
+	if (client->pendingJpegRectsCount == client->pendingJpegRectsSize) {
+		int size = client->pendingJpegRectsSize ?
+		        client->pendingJpegRectsSize * 2 : 16;
+		rect = realloc(client->pendingJpegRects, size * sizeof(*rect));
+		if (!rect)
+			goto failure;
+		client->pendingJpegRects = rect;
+		client->pendingJpegRectsSize = size;
+	}
+
+	rect = &client->pendingJpegRects[client->pendingJpegRectsCount++];
+	rect->data = data;
+	rect->length = length;
+	rect->x = x;
+	rect->y = y;
+	rect->w = w;
+	rect->h = h;
+	rect->flags = flags;
+	return TRUE;
+
+failure:
+	rfbClientLog("Failed to queue JPEG rectangle.\n");
+	free(data);
+	return FALSE;
+}
+
+#else
+
+static rfbBool FlushPendingJpegRects(rfbClient* client)
+{
+	return TRUE;
+}
+
+void FreePendingJpegRects(rfbClient* client)
+{
+}
+
+#endif
+
 #define BPP 8
 #include "rre.c"
 #include "corre.c"
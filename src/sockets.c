@@ -33,60 +33,345 @@
 #include "sockets.h"
 #include "tls.h"
 #include "sasl.h"
+#include "time-util.h"
+#include "usdt.h"
 
 void run_main_loop_once(void);
 
 rfbBool errorMessageOnReadFailure = TRUE;
 
-rfbBool ReadToBuffer(rfbClient* client) {
-	if (client->buffered == RFB_BUF_SIZE)
+/*
+ * The receive buffer is a flat slab with a read cursor (bufoutptr) and a fill
+ * level (buffered). Consumers advance the read cursor; the unread tail is only
+ * moved back to the start of the slab when the free space at the end runs
+ * out, which happens at most once per refill rather than once per read.
+ */
+static void CompactBuffer(rfbClient* client)
+{
+	if (client->bufoutptr == client->buf)
+		return;
+
+	if (client->buffered > 0)
+		memmove(client->buf, client->bufoutptr, client->buffered);
+
+	client->bufoutptr = client->buf;
+}
+
+static unsigned int BufferTailSpace(const rfbClient* client)
+{
+	return RFB_BUF_SIZE - (client->bufoutptr - client->buf) -
+		client->buffered;
+}
+
+/*
+ * Reads larger than this skip the receive buffer once it has been drained and
+ * go straight into the caller's memory.
+ */
+#define DIRECT_READ_THRESHOLD (RFB_BUF_SIZE / 8)
+
+/*
+ * Session recordings start with the state negotiated by
+ * InitialiseRFBConnection(), in host byte order:
+ *
+ *   magic, version, major, minor, server init message, desktop name,
+ *   client pixel format
+ *
+ * followed by everything that was received from the server, in chunks of one
+ * read each:
+ *
+ *   uint64_t time since the start of the recording (us), uint32_t length, data
+ */
+#define RECORDING_MAGIC "WLVNCREC"
+#define RECORDING_VERSION 1
+
+static rfbBool IsRecording(rfbClient* client)
+{
+	return client->vncRec && client->vncRec->recording;
+}
+
+static rfbBool IsReplaying(rfbClient* client)
+{
+	return client->vncRec && !client->vncRec->recording;
+}
+
+static void StopRecording(rfbClient* client)
+{
+	fclose(client->vncRec->file);
+	free(client->vncRec);
+	client->vncRec = NULL;
+}
+
+static void RecordServerData(rfbClient* client, const char* data, size_t len)
+{
+	rfbVNCRec* rec = client->vncRec;
+	uint64_t time = gettime_us() - rec->startTime;
+	uint32_t length = len;
+
+	if (fwrite(&time, sizeof(time), 1, rec->file) != 1 ||
+	    fwrite(&length, sizeof(length), 1, rec->file) != 1 ||
+	    fwrite(data, 1, len, rec->file) != len) {
+		rfbClientErr("Failed to write session recording, stopping\n");
+		StopRecording(client);
+	}
+}
+
+static ssize_t ReadFromRecording(rfbClient* client, char* dst, unsigned int len)
+{
+	rfbVNCRec* rec = client->vncRec;
+
+	if (rec->chunkLeft == 0) {
+		uint64_t time;
+		uint32_t length;
+
+		if (fread(&time, sizeof(time), 1, rec->file) != 1 ||
+		    fread(&length, sizeof(length), 1, rec->file) != 1)
+			return 0;
+
+		rec->chunkLeft = length;
+	}
+
+	size_t size = fread(dst, 1, MIN(len, rec->chunkLeft), rec->file);
+	if (size == 0)
+		return 0;
+
+	rec->chunkLeft -= size;
+	return size;
+}
+
+rfbBool StartRecordingRFBSession(rfbClient* client, const char* path)
+{
+	uint32_t header[3] = { RECORDING_VERSION, client->major, client->minor };
+
+	if (client->vncRec) {
+		rfbClientErr("Session is already being recorded or replayed\n");
 		return FALSE;
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		rfbClientErr("Could not create %s: %s\n", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (fwrite(RECORDING_MAGIC, 8, 1, file) != 1 ||
+	    fwrite(header, sizeof(header), 1, file) != 1 ||
+	    fwrite(&client->si, sz_rfbServerInitMsg, 1, file) != 1 ||
+	    fwrite(client->desktopName, 1, client->si.nameLength, file) !=
+			client->si.nameLength ||
+	    fwrite(&client->format, sz_rfbPixelFormat, 1, file) != 1) {
+		rfbClientErr("Could not write to %s\n", path);
+		goto failure;
+	}
+
+	client->vncRec = calloc(1, sizeof(*client->vncRec));
+	if (!client->vncRec)
+		goto failure;
+
+	client->vncRec->file = file;
+	client->vncRec->recording = TRUE;
+	client->vncRec->startTime = gettime_us();
+
+	/* Anything that arrived along with the end of the handshake */
+	if (client->buffered > 0)
+		RecordServerData(client, client->bufoutptr, client->buffered);
+
+	return TRUE;
+
+failure:
+	fclose(file);
+	return FALSE;
+}
+
+rfbBool StartReplayingRFBSession(rfbClient* client, const char* path)
+{
+	char magic[8];
+	uint32_t header[3];
+
+	if (client->vncRec) {
+		rfbClientErr("Session is already being recorded or replayed\n");
+		return FALSE;
+	}
+
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		rfbClientErr("Could not open %s: %s\n", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (fread(magic, sizeof(magic), 1, file) != 1 ||
+	    memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0 ||
+	    fread(header, sizeof(header), 1, file) != 1 ||
+	    header[0] != RECORDING_VERSION) {
+		rfbClientErr("%s is not a session recording\n", path);
+		goto failure;
+	}
+
+	if (fread(&client->si, sz_rfbServerInitMsg, 1, file) != 1 ||
+	    client->si.nameLength > 1 << 20)
+		goto truncated;
+
+	free(client->desktopName);
+	client->desktopName = malloc(client->si.nameLength + 1);
+	if (!client->desktopName)
+		goto failure;
+
+	if (fread(client->desktopName, 1, client->si.nameLength, file) !=
+			client->si.nameLength ||
+	    fread(&client->format, sz_rfbPixelFormat, 1, file) != 1)
+		goto truncated;
+
+	client->desktopName[client->si.nameLength] = 0;
+	client->major = header[1];
+	client->minor = header[2];
+
+	client->vncRec = calloc(1, sizeof(*client->vncRec));
+	if (!client->vncRec)
+		goto failure;
+
+	client->vncRec->file = file;
+	client->vncRec->doNotSleep = TRUE;
 
-	ssize_t size;
+	rfbClientLog("Replaying \"%s\" from %s\n", client->desktopName, path);
+	return TRUE;
+
+truncated:
+	rfbClientErr("%s is truncated\n", path);
+failure:
+	fclose(file);
+	return FALSE;
+}
+
+rfbBool IsRFBSessionReplayDone(rfbClient* client)
+{
+	return IsReplaying(client) && client->vncRec->chunkLeft == 0 &&
+		feof(client->vncRec->file);
+}
+
+static ssize_t ReadFromTransport(rfbClient* client, char* dst, unsigned int len)
+{
+	if (IsReplaying(client))
+		return ReadFromRecording(client, dst, len);
 
 #if defined(LIBVNCSERVER_HAVE_GNUTLS) || defined(LIBVNCSERVER_HAVE_LIBSSL)
-	if (client->tlsSession) {
-		size = ReadFromTLS(client, client->buf + client->buffered,
-				RFB_BUF_SIZE - client->buffered);
-	} else
+	if (client->tlsSession)
+		return ReadFromTLS(client, dst, len);
 #endif
 #ifdef LIBVNCSERVER_HAVE_SASL
-	if (client->saslconn) {
-		size = ReadFromSASL(client, client->buf + client->buffered,
-				RFB_BUF_SIZE - client->buffered);
-	} else
+	if (client->saslconn)
+		return ReadFromSASL(client, dst, len);
 #endif
-	{
-		size = recv(client->sock, client->buf + client->buffered,
-				RFB_BUF_SIZE - client->buffered, MSG_DONTWAIT);
-	}
+	return recv(client->sock, dst, len, MSG_DONTWAIT);
+}
+
+rfbBool ReadToBuffer(rfbClient* client) {
+	if (client->buffered == 0)
+		client->bufoutptr = client->buf;
+
+	if (client->buffered == RFB_BUF_SIZE)
+		return FALSE;
+
+	if (BufferTailSpace(client) == 0)
+		CompactBuffer(client);
+
+	ssize_t size = ReadFromTransport(client,
+			client->bufoutptr + client->buffered,
+			BufferTailSpace(client));
 
 	if (size == 0)
 		return FALSE;
 
-	if (size > 0)
+	if (size > 0) {
+		DTRACE_PROBE2(wlvncc, socket_read, client, size);
+
+		if (IsRecording(client))
+			RecordServerData(client,
+					client->bufoutptr + client->buffered,
+					size);
+
 		client->buffered += size;
+		client->bytesReceived += size;
+	}
 
 	return TRUE;
 }
 
+static void AwaitServerData(rfbClient* client)
+{
+	/* A recording is never short of data */
+	if (IsReplaying(client))
+		return;
+
+	uint64_t start = gettime_us();
+
+	if (client->WaitForServerData)
+		client->WaitForServerData(client);
+	else
+		run_main_loop_once();
+
+	client->waitTime += gettime_us() - start;
+}
+
+static rfbBool WaitForData(rfbClient* client)
+{
+	AwaitServerData(client);
+	return ReadToBuffer(client);
+}
+
+/* The TLS backends report fatal errors as EINTR, so it only means that the
+ * read was interrupted when it went to the socket itself.
+ */
+static rfbBool IsTransientReadError(rfbClient* client)
+{
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return TRUE;
+
+	return errno == EINTR && !client->tlsSession;
+}
+
+static rfbBool ReadDirect(rfbClient* client, char** out, unsigned int* n)
+{
+	ssize_t size = ReadFromTransport(client, *out, *n);
+	if (size == 0)
+		return FALSE;
+
+	if (size < 0) {
+		if (!IsTransientReadError(client))
+			return FALSE;
+
+		AwaitServerData(client);
+		return TRUE;
+	}
+
+	DTRACE_PROBE2(wlvncc, socket_read, client, size);
+
+	if (IsRecording(client))
+		RecordServerData(client, *out, size);
+
+	*out += size;
+	*n -= size;
+	client->bytesReceived += size;
+	return TRUE;
+}
+
 rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 {
 	if (!out)
 		return FALSE;
 
 	while (n != 0) {
-		while (n != 0 && client->buffered == 0) {
-			run_main_loop_once();
-			if (!ReadToBuffer(client))
+		if (client->buffered == 0) {
+			rfbBool ok = n >= DIRECT_READ_THRESHOLD ?
+				ReadDirect(client, &out, &n) : WaitForData(client);
+			if (!ok)
 				return FALSE;
+			continue;
 		}
 
 		unsigned int size = MIN(client->buffered, n);
-		memcpy(out, client->buf, size);
+		memcpy(out, client->bufoutptr, size);
 
+		client->bufoutptr += size;
 		client->buffered -= size;
-		memmove(client->buf, client->buf + size, client->buffered);
 
 		out += size;
 		n -= size;
@@ -95,11 +380,35 @@ rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	return TRUE;
 }
 
+rfbBool PeekFromRFBServer(rfbClient* client, const char** span, unsigned int n)
+{
+	if (n > RFB_BUF_SIZE)
+		return FALSE;
+
+	if (client->buffered < n && BufferTailSpace(client) < n - client->buffered)
+		CompactBuffer(client);
+
+	while (client->buffered < n)
+		if (!WaitForData(client))
+			return FALSE;
+
+	*span = client->bufoutptr;
+	return TRUE;
+}
+
+void SkipFromRFBServer(rfbClient* client, unsigned int n)
+{
+	assert(n <= client->buffered);
+
+	client->bufoutptr += n;
+	client->buffered -= n;
+}
+
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
  */
-rfbBool
-WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
+static rfbBool
+WriteExact(rfbClient* client, const char *buf, unsigned int n)
 {
 	struct pollfd fds;
 	int i = 0;
@@ -162,6 +471,21 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
 	return TRUE;
 }
 
+rfbBool
+WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
+{
+	/* There is nobody to talk to */
+	if (IsReplaying(client))
+		return TRUE;
+
+	/* Input events and update requests may be sent from different threads */
+	LOCK(client->writeMutex);
+	rfbBool ok = WriteExact(client, buf, n);
+	UNLOCK(client->writeMutex);
+
+	return ok;
+}
+
 static rfbBool WaitForConnected(int socket, unsigned int secs)
 {
 	struct pollfd fds = {
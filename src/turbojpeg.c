@@ -849,6 +849,106 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	return retval;
 }
 
+DLLEXPORT int DLLCALL tjPlaneWidth(int componentID, int width, int subsamp)
+{
+	int pw;
+	if(width<1 || subsamp<0 || subsamp>=NUMSUBOPT || componentID<0
+		|| componentID>2) return -1;
+	if(subsamp==TJSAMP_GRAY && componentID>0) return -1;
+	pw=PAD(width, tjMCUWidth[subsamp]);
+	if(componentID==0) return pw;
+	return pw*8/tjMCUWidth[subsamp];
+}
+
+DLLEXPORT int DLLCALL tjPlaneHeight(int componentID, int height, int subsamp)
+{
+	int ph;
+	if(height<1 || subsamp<0 || subsamp>=NUMSUBOPT || componentID<0
+		|| componentID>2) return -1;
+	if(subsamp==TJSAMP_GRAY && componentID>0) return -1;
+	ph=PAD(height, tjMCUHeight[subsamp]);
+	if(componentID==0) return ph;
+	return ph*8/tjMCUHeight[subsamp];
+}
+
+DLLEXPORT int DLLCALL tjDecompressToYUVPlanes(tjhandle handle,
+	unsigned char *jpegBuf, unsigned long jpegSize, unsigned char **dstPlanes,
+	int *strides, int flags)
+{
+	int i, row, retval=0, subsamp;  JSAMPROW *rows=NULL;
+	JSAMPARRAY planes[MAX_COMPONENTS];
+	int ph[MAX_COMPONENTS], nrows=0;
+
+	getinstance(handle);
+	if((this->init&DECOMPRESS)==0)
+		_throw("tjDecompressToYUVPlanes(): Instance has not been initialized for decompression");
+
+	if(jpegBuf==NULL || jpegSize<=0 || dstPlanes==NULL || strides==NULL)
+		_throw("tjDecompressToYUVPlanes(): Invalid argument");
+
+	if(flags&TJFLAG_FORCEMMX) putenv("JSIMD_FORCEMMX=1");
+	else if(flags&TJFLAG_FORCESSE) putenv("JSIMD_FORCESSE=1");
+	else if(flags&TJFLAG_FORCESSE2) putenv("JSIMD_FORCESSE2=1");
+
+	if(setjmp(this->jerr.setjmp_buffer))
+	{
+		/* If we get here, the JPEG code has signaled an error. */
+		retval=-1;
+		goto bailout;
+	}
+
+	this->jsrc.bytes_in_buffer=jpegSize;
+	this->jsrc.next_input_byte=jpegBuf;
+	jpeg_read_header(dinfo, TRUE);
+
+	subsamp=getSubsamp(dinfo);
+	if(subsamp<0 || subsamp==TJSAMP_GRAY
+		|| dinfo->jpeg_color_space!=JCS_YCbCr)
+		_throw("tjDecompressToYUVPlanes(): JPEG image is not planar YCbCr");
+
+	for(i=0; i<3; i++)
+	{
+		if(dstPlanes[i]==NULL || strides[i]<tjPlaneWidth(i,
+			dinfo->image_width, subsamp))
+			_throw("tjDecompressToYUVPlanes(): Invalid argument");
+		ph[i]=tjPlaneHeight(i, dinfo->image_height, subsamp);
+		nrows+=ph[i];
+	}
+
+	if((rows=(JSAMPROW *)malloc(sizeof(JSAMPROW)*nrows))==NULL)
+		_throw("tjDecompressToYUVPlanes(): Memory allocation failure");
+	for(i=0, nrows=0; i<3; i++)
+	{
+		planes[i]=&rows[nrows];
+		for(row=0; row<ph[i]; row++)
+			rows[nrows++]=&dstPlanes[i][row*strides[i]];
+	}
+
+	dinfo->raw_data_out=TRUE;
+	jpeg_start_decompress(dinfo);
+
+	/* Each call to jpeg_read_raw_data() produces one iMCU row, which is
+	 * v_samp_factor * DCTSIZE lines of each component.
+	 */
+	while(dinfo->output_scanline<dinfo->output_height)
+	{
+		JSAMPARRAY yuv[MAX_COMPONENTS];
+		int imcu=dinfo->output_scanline/(dinfo->max_v_samp_factor*DCTSIZE);
+		for(i=0; i<3; i++)
+			yuv[i]=&planes[i][imcu*dinfo->comp_info[i].v_samp_factor*DCTSIZE];
+		if(jpeg_read_raw_data(dinfo, yuv,
+			dinfo->max_v_samp_factor*DCTSIZE)==0)
+			_throw("tjDecompressToYUVPlanes(): Premature end of JPEG data");
+	}
+	jpeg_finish_decompress(dinfo);
+
+	bailout:
+	if(dinfo->global_state>DSTATE_START) jpeg_abort_decompress(dinfo);
+	dinfo->raw_data_out=FALSE;
+	if(rows) free(rows);
+	return retval;
+}
+
 DLLEXPORT int DLLCALL tjDecompress(tjhandle handle, unsigned char *jpegBuf,
 	unsigned long jpegSize, unsigned char *dstBuf, int width, int pitch,
 	int height, int pixelSize, int flags)
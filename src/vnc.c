@@ -15,11 +15,18 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <pixman.h>
 #include <libdrm/drm_fourcc.h>
 #include <libavutil/frame.h>
@@ -27,12 +34,62 @@
 #include "rfbclient.h"
 #include "vnc.h"
 #include "open-h264.h"
+#include "worker-pool.h"
+#include "quality-controller.h"
+#include "time-util.h"
 #include "usdt.h"
 
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+#include "turbojpeg.h"
+#endif
+
 #define RFB_ENCODING_OPEN_H264 50
 #define RFB_ENCODING_PTS -1000
 
-#define NO_PTS UINT64_MAX
+#define VNC_THREAD_QUEUE_SIZE 64
+#define VNC_MAX_DECODE_WORKERS 8
+
+enum vnc_thread_event_type {
+	VNC_THREAD_EVENT_ALLOC_FB,
+	VNC_THREAD_EVENT_UPDATE_FB,
+	VNC_THREAD_EVENT_CUT_TEXT,
+	VNC_THREAD_EVENT_DISCONNECT,
+};
+
+struct vnc_thread_event {
+	enum vnc_thread_event_type type;
+	char* text;
+	size_t len;
+};
+
+/* Events flow from the protocol thread to the main thread through a
+ * single-producer, single-consumer ring. The main thread is woken up via
+ * wake_fd and it acknowledges each batch of events via ack_fd. The main
+ * thread asks for the whole framebuffer to be sent again via refresh_fd.
+ *
+ * While a frame is pending, the main thread owns the framebuffer, the damage
+ * region and the av frames. The protocol thread waits for the frame to be
+ * released before it starts decoding the next update.
+ */
+struct vnc_thread {
+	pthread_t thread;
+	int wake_fd;
+	int ack_fd;
+	int refresh_fd;
+
+	atomic_bool stop;
+	atomic_bool frame_pending;
+	atomic_bool alloc_pending;
+	int alloc_result;
+
+	atomic_uint head;
+	atomic_uint tail;
+	struct vnc_thread_event events[VNC_THREAD_QUEUE_SIZE];
+
+	// Taken after each update for the main thread to read
+	pthread_mutex_t stats_mutex;
+	rfbEncodingStats encoding_stats[rfbStatsEncodingCount];
+};
 
 extern const unsigned short code_map_linux_to_qnum[];
 extern const unsigned int code_map_linux_to_qnum_len;
@@ -61,12 +118,202 @@ static void vnc_client_unlock_handler(struct vnc_client* self)
 	self->handler_lock = false;
 }
 
+static bool vnc_thread_is_stopping(struct vnc_thread* thread)
+{
+	return atomic_load(&thread->stop);
+}
+
+static void vnc_thread_wait_for_ack(struct vnc_thread* thread)
+{
+	uint64_t count;
+	while (read(thread->ack_fd, &count, sizeof(count)) < 0 &&
+			errno == EINTR);
+}
+
+static void vnc_thread_post(struct vnc_thread* thread,
+		const struct vnc_thread_event* event)
+{
+	unsigned int tail = atomic_load_explicit(&thread->tail,
+			memory_order_relaxed);
+
+	while (tail - atomic_load_explicit(&thread->head, memory_order_acquire)
+			== VNC_THREAD_QUEUE_SIZE) {
+		if (vnc_thread_is_stopping(thread)) {
+			free(event->text);
+			return;
+		}
+		vnc_thread_wait_for_ack(thread);
+	}
+
+	thread->events[tail % VNC_THREAD_QUEUE_SIZE] = *event;
+	atomic_store_explicit(&thread->tail, tail + 1, memory_order_release);
+
+	uint64_t one = 1;
+	write(thread->wake_fd, &one, sizeof(one));
+}
+
+static void vnc_thread_wait_for_frame(struct vnc_thread* thread)
+{
+	while (atomic_load(&thread->frame_pending) &&
+			!vnc_thread_is_stopping(thread))
+		vnc_thread_wait_for_ack(thread);
+}
+
+static int vnc_thread_alloc_fb(struct vnc_thread* thread)
+{
+	vnc_thread_wait_for_frame(thread);
+
+	atomic_store(&thread->alloc_pending, true);
+
+	struct vnc_thread_event event = { .type = VNC_THREAD_EVENT_ALLOC_FB };
+	vnc_thread_post(thread, &event);
+
+	while (atomic_load(&thread->alloc_pending)) {
+		if (vnc_thread_is_stopping(thread))
+			return -1;
+		vnc_thread_wait_for_ack(thread);
+	}
+
+	return thread->alloc_result;
+}
+
+static int vnc_client_make_pixel_format(rfbPixelFormat* dst, uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+		dst->redShift = 16;
+		dst->greenShift = 8;
+		dst->blueShift = 0;
+		dst->bitsPerPixel = 32;
+		break;
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+		dst->redShift = 0;
+		dst->greenShift = 8;
+		dst->blueShift = 16;
+		dst->bitsPerPixel = 32;
+		break;
+	case DRM_FORMAT_RGB565:
+		dst->redShift = 11;
+		dst->greenShift = 5;
+		dst->blueShift = 0;
+		dst->bitsPerPixel = 16;
+		break;
+	case DRM_FORMAT_BGR233:
+		dst->redShift = 0;
+		dst->greenShift = 3;
+		dst->blueShift = 6;
+		dst->bitsPerPixel = 8;
+		break;
+	default:
+		return -1;
+	}
+
+	switch (dst->bitsPerPixel) {
+	case 32:
+		dst->depth = 24;
+		dst->redMax = 0xff;
+		dst->greenMax = 0xff;
+		dst->blueMax = 0xff;
+		break;
+	case 16:
+		dst->depth = 16;
+		dst->redMax = 0x1f;
+		dst->greenMax = 0x3f;
+		dst->blueMax = 0x1f;
+		break;
+	case 8:
+		dst->depth = 8;
+		dst->redMax = 0x7;
+		dst->greenMax = 0x7;
+		dst->blueMax = 0x3;
+		break;
+	default:
+		abort();
+	}
+
+	dst->trueColour = 1;
+	dst->bigEndian = FALSE;
+
+	return 0;
+}
+
+static uint32_t vnc_client_drm_format(const struct vnc_client* self,
+		const rfbPixelFormat* format)
+{
+	switch (format->bitsPerPixel) {
+	case 32: return self->pixel_format;
+	case 16: return DRM_FORMAT_RGB565;
+	case 8: return DRM_FORMAT_BGR233;
+	}
+
+	return DRM_FORMAT_INVALID;
+}
+
 static rfbBool vnc_client_alloc_fb(rfbClient* client)
 {
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
-	return self->alloc_fb(self) < 0 ? FALSE : TRUE;
+	self->fb_pixel_format = vnc_client_drm_format(self, &client->format);
+	pixman_region_clear(&self->stale_fb);
+
+	int rc = self->thread ? vnc_thread_alloc_fb(self->thread) :
+		self->alloc_fb(self);
+	return rc < 0 ? FALSE : TRUE;
+}
+
+static struct vnc_render_op* vnc_client_add_render_op(struct vnc_client* self,
+		enum vnc_render_op_type type, int x, int y, int width,
+		int height)
+{
+	if (self->n_render_ops == self->render_ops_size) {
+		int size = self->render_ops_size ?
+			self->render_ops_size * 2 : 64;
+		struct vnc_render_op* ops = realloc(self->render_ops,
+				size * sizeof(*ops));
+		if (!ops)
+			return NULL;
+
+		self->render_ops = ops;
+		self->render_ops_size = size;
+	}
+
+	struct vnc_render_op* op = &self->render_ops[self->n_render_ops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->x = x;
+	op->y = y;
+	op->width = width;
+	op->height = height;
+	return op;
+}
+
+static void vnc_client_clear_render_ops(struct vnc_client* self)
+{
+	for (int i = 0; i < self->n_render_ops; ++i) {
+		free(self->render_ops[i].yuv.jpeg);
+		free(self->render_ops[i].yuv.planes[0]);
+	}
+	self->n_render_ops = 0;
+}
+
+static bool vnc_client_uses_render_ops(const struct vnc_client* self)
+{
+	return self->decode_jpeg_to_yuv || self->gpu_copy_rect;
+}
+
+/* Updates that turned out to be plain uploads are handled through the
+ * damage region, which merges overlapping rectangles.
+ */
+static void vnc_client_drop_upload_only_ops(struct vnc_client* self)
+{
+	for (int i = 0; i < self->n_render_ops; ++i)
+		if (self->render_ops[i].type != VNC_RENDER_OP_UPLOAD)
+			return;
+
+	self->n_render_ops = 0;
 }
 
 static void vnc_client_update_box(rfbClient* client, int x, int y, int width,
@@ -75,15 +322,284 @@ static void vnc_client_update_box(rfbClient* client, int x, int y, int width,
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
+	if (width > 0 && height > 0)
+		self->update_pixels += (uint64_t)width * height;
+
 	if (self->current_rect_is_av_frame) {
 		self->current_rect_is_av_frame = false;
 		return;
 	}
 
+	if (self->current_rect_is_render_op) {
+		self->current_rect_is_render_op = false;
+		return;
+	}
+
+	if (width <= 0 || height <= 0)
+		return;
+
 	pixman_region_union_rect(&self->damage, &self->damage, x, y, width,
 			height);
+
+	if (self->gpu_copy_rect) {
+		pixman_region_union_rect(&self->update_uploads,
+				&self->update_uploads, x, y, width, height);
+		pixman_region_subtract(&self->stale_fb, &self->stale_fb,
+				&self->update_uploads);
+	}
+
+	if (vnc_client_uses_render_ops(self) &&
+			!vnc_client_add_render_op(self, VNC_RENDER_OP_UPLOAD,
+				x, y, width, height))
+		fprintf(stderr, "Failed to record framebuffer update\n");
+}
+
+static bool vnc_client_fb_is_stale(struct vnc_client* self, int x, int y,
+		int width, int height)
+{
+	pixman_box16_t box = { x, y, x + width, y + height };
+	return pixman_region_contains_rectangle(&self->stale_fb, &box) !=
+		PIXMAN_REGION_OUT;
 }
 
+/* Uploads of the current update are replayed from the framebuffer as it is
+ * at the end of the update, so a copy from an area that has just been
+ * decoded must be done there too. Packed 8 bit textures can't be drawn into.
+ */
+static bool vnc_client_copy_on_gpu(struct vnc_client* self, int src_x,
+		int src_y, int width, int height)
+{
+	pixman_box16_t box = { src_x, src_y, src_x + width, src_y + height };
+
+	return self->gpu_copy_rect &&
+		self->fb_pixel_format != DRM_FORMAT_BGR233 &&
+		pixman_region_contains_rectangle(&self->update_uploads, &box) ==
+			PIXMAN_REGION_OUT;
+}
+
+static void vnc_client_copy_rect(rfbClient* client, int src_x, int src_y,
+		int width, int height, int dst_x, int dst_y)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	if (self->decode_jpeg_to_yuv) {
+		// The source may not be in the framebuffer, but the rest of it is
+		self->copy_rect(client, src_x, src_y, width, height, dst_x,
+				dst_y);
+	} else if (!vnc_client_copy_on_gpu(self, src_x, src_y, width,
+				height)) {
+		/* Copying stale pixels would overwrite the texture with wrong
+		 * ones, so it keeps what it has until the server has sent the
+		 * destination again.
+		 */
+		if (vnc_client_fb_is_stale(self, src_x, src_y, width, height)) {
+			SendFramebufferUpdateRequest(client, dst_x, dst_y,
+					width, height, FALSE);
+			pixman_region_union_rect(&self->stale_fb,
+					&self->stale_fb, dst_x, dst_y, width,
+					height);
+			pixman_region_subtract(&self->update_uploads,
+					&self->update_uploads, &self->stale_fb);
+			self->current_rect_is_render_op = true;
+			return;
+		}
+
+		// The destination is uploaded from the framebuffer instead
+		self->copy_rect(client, src_x, src_y, width, height, dst_x,
+				dst_y);
+		return;
+	}
+
+	struct vnc_render_op* op = vnc_client_add_render_op(self,
+			VNC_RENDER_OP_COPY, dst_x, dst_y, width, height);
+	if (!op) {
+		if (!self->decode_jpeg_to_yuv)
+			self->copy_rect(client, src_x, src_y, width, height,
+					dst_x, dst_y);
+		return;
+	}
+
+	/* Only the texture has the copied pixels, so they must not be read
+	 * from the framebuffer until they have been decoded again.
+	 */
+	if (!self->decode_jpeg_to_yuv)
+		pixman_region_union_rect(&self->stale_fb, &self->stale_fb,
+				dst_x, dst_y, width, height);
+
+	op->src_x = src_x;
+	op->src_y = src_y;
+
+	self->current_rect_is_render_op = true;
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+static void* vnc_client_get_tj_handle(struct vnc_client* self, int worker)
+{
+	if (!self->tj_handles) {
+		int n = self->client->workerPool ?
+			worker_pool_get_n_workers(self->client->workerPool) : 1;
+		self->tj_handles = calloc(n, sizeof(*self->tj_handles));
+		if (!self->tj_handles)
+			return NULL;
+		self->n_tj_handles = n;
+	}
+
+	if (!self->tj_handles[worker])
+		self->tj_handles[worker] = tjInitDecompress();
+
+	return self->tj_handles[worker];
+}
+
+/* Grayscale JPEG has no chroma planes, so it goes the usual way. */
+static rfbBool vnc_client_decode_jpeg_to_fb(struct vnc_client* self,
+		void* tj, const uint8_t* jpeg, int len, int x, int y,
+		int width, int height)
+{
+	rfbClient* client = self->client;
+	assert(client->format.bitsPerPixel == 32);
+	int pixel_format = client->format.redShift == 16 ?
+		TJPF_BGRX : TJPF_RGBX;
+	int stride = vnc_client_get_stride(self);
+	uint8_t* dst = (uint8_t*)client->frameBuffer + y * stride + x * 4;
+
+	if (tjDecompress2(tj, (uint8_t*)jpeg, len, dst, width, stride, height,
+				pixel_format, 0) < 0) {
+		fprintf(stderr, "TurboJPEG error: %s\n", tjGetErrorStr());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rfbBool vnc_client_got_jpeg(rfbClient* client, const uint8_t* jpeg,
+		int len, int x, int y, int width, int height)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	void* tj = vnc_client_get_tj_handle(self, 0);
+	if (!tj) {
+		fprintf(stderr, "Failed to create TurboJPEG decompressor\n");
+		return FALSE;
+	}
+
+	int jpeg_width, jpeg_height, subsamp;
+	if (tjDecompressHeader2(tj, (uint8_t*)jpeg, len, &jpeg_width,
+				&jpeg_height, &subsamp) < 0) {
+		fprintf(stderr, "TurboJPEG error: %s\n", tjGetErrorStr());
+		return FALSE;
+	}
+
+	if (jpeg_width != width || jpeg_height != height) {
+		fprintf(stderr, "JPEG size does not match its rectangle\n");
+		return FALSE;
+	}
+
+	if (subsamp == TJSAMP_GRAY)
+		return vnc_client_decode_jpeg_to_fb(self, tj, jpeg, len, x, y,
+				width, height);
+
+	struct vnc_render_op* op = vnc_client_add_render_op(self,
+			VNC_RENDER_OP_YUV, x, y, width, height);
+	if (!op)
+		return FALSE;
+
+	op->yuv.jpeg = malloc(len);
+	if (!op->yuv.jpeg) {
+		self->n_render_ops--;
+		return FALSE;
+	}
+
+	memcpy(op->yuv.jpeg, jpeg, len);
+	op->yuv.jpeg_len = len;
+	op->yuv.subsamp = subsamp;
+
+	self->current_rect_is_render_op = true;
+	return TRUE;
+}
+
+static void vnc_client_decode_yuv_frame(void* userdata, int job, int worker)
+{
+	struct vnc_client* self = userdata;
+	struct vnc_render_op* op = &self->render_ops[job];
+	struct vnc_yuv_frame* frame = &op->yuv;
+
+	if (op->type != VNC_RENDER_OP_YUV)
+		return;
+
+	void* tj = vnc_client_get_tj_handle(self, worker);
+	if (!tj)
+		return;
+
+	int heights[3];
+	size_t size = 0;
+	for (int i = 0; i < 3; ++i) {
+		frame->strides[i] = tjPlaneWidth(i, op->width, frame->subsamp);
+		heights[i] = tjPlaneHeight(i, op->height, frame->subsamp);
+		size += (size_t)frame->strides[i] * heights[i];
+	}
+
+	uint8_t* planes = malloc(size);
+	if (!planes)
+		return;
+
+	frame->planes[0] = planes;
+	frame->planes[1] = frame->planes[0] + frame->strides[0] * heights[0];
+	frame->planes[2] = frame->planes[1] + frame->strides[1] * heights[1];
+
+	if (tjDecompressToYUVPlanes(tj, frame->jpeg, frame->jpeg_len,
+				frame->planes, frame->strides, 0) < 0) {
+		fprintf(stderr, "TurboJPEG error: %s\n", tjGetErrorStr());
+		free(planes);
+		memset(frame->planes, 0, sizeof(frame->planes));
+		return;
+	}
+
+	int chroma_x = tjMCUWidth[frame->subsamp] / 8;
+	int chroma_y = tjMCUHeight[frame->subsamp] / 8;
+	frame->chroma_width = (op->width + chroma_x - 1) / chroma_x;
+	frame->chroma_height = (op->height + chroma_y - 1) / chroma_y;
+}
+
+static void vnc_client_decode_yuv_frames(struct vnc_client* self)
+{
+	if (self->n_render_ops == 0)
+		return;
+
+	// The handles must exist before the workers go looking for them
+	if (!vnc_client_get_tj_handle(self, 0))
+		return;
+
+	if (!self->client->workerPool) {
+		for (int i = 0; i < self->n_render_ops; ++i)
+			vnc_client_decode_yuv_frame(self, i, 0);
+		return;
+	}
+
+	worker_pool_run(self->client->workerPool, vnc_client_decode_yuv_frame,
+			self, self->n_render_ops);
+}
+
+static void vnc_client_destroy_tj_handles(struct vnc_client* self)
+{
+	for (int i = 0; i < self->n_tj_handles; ++i)
+		if (self->tj_handles[i])
+			tjDestroy(self->tj_handles[i]);
+	free(self->tj_handles);
+	self->tj_handles = NULL;
+	self->n_tj_handles = 0;
+}
+#else
+static void vnc_client_decode_yuv_frames(struct vnc_client* self)
+{
+}
+
+static void vnc_client_destroy_tj_handles(struct vnc_client* self)
+{
+}
+#endif
+
 static void vnc_client_clear_av_frames(struct vnc_client* self)
 {
 	for (int i = 0; i < self->n_av_frames; ++i) {
@@ -99,9 +615,26 @@ static void vnc_client_start_update(rfbClient* client)
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
+	if (self->thread)
+		vnc_thread_wait_for_frame(self->thread);
+
+	// The refresh for this has been requested already
+	if (self->gpu_copy_rect && atomic_load(&self->gpu_copy_rect_failed)) {
+		self->gpu_copy_rect = false;
+		pixman_region_clear(&self->stale_fb);
+	}
+
 	self->pts = NO_PTS;
 	pixman_region_clear(&self->damage);
+	pixman_region_clear(&self->update_uploads);
 	vnc_client_clear_av_frames(self);
+	vnc_client_clear_render_ops(self);
+
+	self->update_start = gettime_us();
+	self->update_wait_start = client->waitTime;
+	self->update_pixels = 0;
+
+	DTRACE_PROBE1(wlvncc, vnc_client_start_update, client);
 
 	self->is_updating = true;
 }
@@ -114,6 +647,146 @@ static void vnc_client_cancel_update(rfbClient* client)
 	self->is_updating = false;
 }
 
+static bool vnc_client_has_encoding(const char* list, const char* name)
+{
+	size_t len = strlen(name);
+
+	for (const char* p = list; p; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+
+		if (strncasecmp(p, name, len) == 0 &&
+				(p[len] == ',' || p[len] == '\0'))
+			return true;
+	}
+
+	return false;
+}
+
+/* Moves open-h264 to the front of the encoding list if it is preferred and
+ * to the back otherwise. The server picks the first one that it supports.
+ * The list is passed through as it is if open-h264 is not in it.
+ */
+static char* vnc_client_order_encodings(const char* list, bool prefer_h264)
+{
+	static const char h264[] = "open-h264";
+	size_t h264_len = sizeof(h264) - 1;
+
+	if (!vnc_client_has_encoding(list, h264))
+		return strdup(list);
+
+	char* result = malloc(strlen(list) + 1);
+	if (!result)
+		return NULL;
+
+	char* out = result;
+
+	if (prefer_h264) {
+		memcpy(out, h264, h264_len);
+		out += h264_len;
+	}
+
+	const char* p = list;
+	while (*p) {
+		const char* end = strchrnul(p, ',');
+		size_t len = end - p;
+
+		if (len > 0 && !(len == h264_len &&
+					strncasecmp(p, h264, len) == 0)) {
+			if (out != result)
+				*out++ = ',';
+			memcpy(out, p, len);
+			out += len;
+		}
+
+		p = *end ? end + 1 : end;
+	}
+
+	if (!prefer_h264) {
+		if (out != result)
+			*out++ = ',';
+		memcpy(out, h264, h264_len);
+		out += h264_len;
+	}
+
+	*out = '\0';
+	return result;
+}
+
+static void vnc_client_apply_bits_per_pixel(struct vnc_client* self,
+		int bits_per_pixel)
+{
+	rfbClient* client = self->client;
+	const rfbPixelFormat* current = client->pixelFormatChangesInFlight ?
+		&client->requestedFormat : &client->format;
+
+	if (current->bitsPerPixel == bits_per_pixel)
+		return;
+
+	rfbPixelFormat format = { 0 };
+	uint32_t drm_format = bits_per_pixel == 32 ? self->pixel_format :
+		bits_per_pixel == 16 ? DRM_FORMAT_RGB565 : DRM_FORMAT_BGR233;
+	if (vnc_client_make_pixel_format(&format, drm_format) < 0)
+		return;
+
+	if (!SendPixelFormatChange(client, &format))
+		fprintf(stderr, "Failed to change pixel format\n");
+}
+
+static void vnc_client_apply_quality_settings(struct vnc_client* self,
+		const struct quality_settings* settings)
+{
+	rfbClient* client = self->client;
+
+	DTRACE_PROBE4(wlvncc, vnc_client_quality_changed, client,
+			settings->quality, settings->prefer_h264,
+			settings->bits_per_pixel);
+
+	vnc_client_apply_bits_per_pixel(self, settings->bits_per_pixel);
+
+	if (self->quality_level == settings->quality &&
+			self->prefer_h264 == settings->prefer_h264)
+		return;
+
+	char* encodings = vnc_client_order_encodings(
+			client->appData.encodingsString, settings->prefer_h264);
+	if (!encodings)
+		return;
+
+	self->quality_level = settings->quality;
+	client->appData.qualityLevel = settings->quality;
+	client->appData.encodingsString = encodings;
+	free(self->adaptive_encodings);
+	self->adaptive_encodings = encodings;
+	self->prefer_h264 = settings->prefer_h264;
+
+	if (!SetFormatAndEncodings(client))
+		fprintf(stderr, "Failed to change quality settings\n");
+}
+
+static void vnc_client_sample_quality(struct vnc_client* self)
+{
+	rfbClient* client = self->client;
+	uint64_t now = gettime_us();
+
+	uint64_t wait_time = client->waitTime - self->update_wait_start;
+	uint64_t update_time = now - self->update_start;
+
+	struct quality_sample sample = {
+		.bytes = client->bytesReceived - self->last_bytes_received,
+		.pixels = self->update_pixels,
+		.decode_time = update_time > wait_time ?
+			update_time - wait_time : 0,
+		.round_trip = client->fenceRoundTrip,
+	};
+	self->last_bytes_received = client->bytesReceived;
+
+	struct quality_settings settings;
+	if (quality_controller_add_sample(self->quality_controller, &sample,
+				now, &settings))
+		vnc_client_apply_quality_settings(self, &settings);
+}
+
 static void vnc_client_finish_update(rfbClient* client)
 {
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
@@ -123,6 +796,27 @@ static void vnc_client_finish_update(rfbClient* client)
 
 	self->is_updating = false;
 
+	vnc_client_decode_yuv_frames(self);
+	vnc_client_drop_upload_only_ops(self);
+
+	if (self->quality_controller)
+		vnc_client_sample_quality(self);
+
+	if (self->thread) {
+		pthread_mutex_lock(&self->thread->stats_mutex);
+		memcpy(self->thread->encoding_stats, client->encodingStats,
+				sizeof(self->thread->encoding_stats));
+		pthread_mutex_unlock(&self->thread->stats_mutex);
+
+		atomic_store(&self->thread->frame_pending, true);
+
+		struct vnc_thread_event event = {
+			.type = VNC_THREAD_EVENT_UPDATE_FB,
+		};
+		vnc_thread_post(self->thread, &event);
+		return;
+	}
+
 	self->update_fb(self);
 }
 
@@ -132,8 +826,24 @@ static void vnc_client_got_cut_text(rfbClient* client, const char* text,
 	struct vnc_client* self = rfbClientGetClientData(client, NULL);
 	assert(self);
 
-	if (self->cut_text)
+	if (!self->cut_text)
+		return;
+
+	if (!self->thread) {
 		self->cut_text(self, text, len);
+		return;
+	}
+
+	struct vnc_thread_event event = {
+		.type = VNC_THREAD_EVENT_CUT_TEXT,
+		.text = malloc(len),
+		.len = len,
+	};
+	if (!event.text)
+		return;
+
+	memcpy(event.text, text, len);
+	vnc_thread_post(self->thread, &event);
 }
 
 static rfbBool vnc_client_handle_open_h264_rect(rfbClient* client,
@@ -216,6 +926,229 @@ static void vnc_client_init_pts_ext(void)
 	rfbClientRegisterExtension(&ext);
 }
 
+static void vnc_client_send_refresh(struct vnc_client* self)
+{
+	rfbClient* client = self->client;
+	SendFramebufferUpdateRequest(client, 0, 0, client->width,
+			client->height, FALSE);
+}
+
+static void vnc_client_send_pending_refresh(struct vnc_client* self)
+{
+	uint64_t count = 0;
+	if (read(self->thread->refresh_fd, &count, sizeof(count)) > 0)
+		vnc_client_send_refresh(self);
+}
+
+static void vnc_client_wait_for_server_data(rfbClient* client)
+{
+	struct vnc_client* self = rfbClientGetClientData(client, NULL);
+	assert(self);
+
+	// A replayed session is read from a file, which never has to wait
+	if (client->vncRec && !client->vncRec->recording)
+		return;
+
+	struct pollfd pfd[2] = {
+		{ .fd = client->sock, .events = POLLIN },
+		{ .fd = self->thread ? self->thread->refresh_fd : -1,
+			.events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			vnc_client_send_pending_refresh(self);
+
+		if (pfd[0].revents)
+			return;
+	}
+}
+
+static void* vnc_thread_run(void* userdata)
+{
+	struct vnc_client* self = userdata;
+	struct vnc_thread* thread = self->thread;
+
+	while (!vnc_thread_is_stopping(thread)) {
+		vnc_client_send_pending_refresh(self);
+
+		if (self->client->buffered == 0)
+			vnc_client_wait_for_server_data(self->client);
+
+		if (vnc_client_process(self) < 0)
+			break;
+	}
+
+	struct vnc_thread_event event = { .type = VNC_THREAD_EVENT_DISCONNECT };
+	vnc_thread_post(thread, &event);
+	return NULL;
+}
+
+static int vnc_client_start_thread(struct vnc_client* self)
+{
+	struct vnc_thread* thread = calloc(1, sizeof(*thread));
+	if (!thread)
+		return -1;
+
+	thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->wake_fd < 0)
+		goto wake_fd_failure;
+
+	thread->ack_fd = eventfd(0, EFD_CLOEXEC);
+	if (thread->ack_fd < 0)
+		goto ack_fd_failure;
+
+	thread->refresh_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->refresh_fd < 0)
+		goto refresh_fd_failure;
+
+	pthread_mutex_init(&thread->stats_mutex, NULL);
+	memcpy(thread->encoding_stats, self->client->encodingStats,
+			sizeof(thread->encoding_stats));
+
+	self->thread = thread;
+	self->client->WaitForServerData = vnc_client_wait_for_server_data;
+
+	if (pthread_create(&thread->thread, NULL, vnc_thread_run, self) != 0)
+		goto thread_failure;
+
+	return 0;
+
+thread_failure:
+	self->thread = NULL;
+	pthread_mutex_destroy(&thread->stats_mutex);
+	close(thread->refresh_fd);
+refresh_fd_failure:
+	close(thread->ack_fd);
+ack_fd_failure:
+	close(thread->wake_fd);
+wake_fd_failure:
+	free(thread);
+	return -1;
+}
+
+void vnc_client_stop_thread(struct vnc_client* self)
+{
+	struct vnc_thread* thread = self->thread;
+	if (!thread)
+		return;
+
+	atomic_store(&thread->stop, true);
+
+	/* Wake the protocol thread up, whether it is waiting for data or for
+	 * the main thread.
+	 */
+	shutdown(self->client->sock, SHUT_RD);
+	uint64_t one = 1;
+	write(thread->ack_fd, &one, sizeof(one));
+
+	pthread_join(thread->thread, NULL);
+
+	unsigned int tail = atomic_load(&thread->tail);
+	for (unsigned int i = atomic_load(&thread->head); i != tail; ++i)
+		free(thread->events[i % VNC_THREAD_QUEUE_SIZE].text);
+
+	pthread_mutex_destroy(&thread->stats_mutex);
+	close(thread->refresh_fd);
+	close(thread->ack_fd);
+	close(thread->wake_fd);
+	free(thread);
+	self->thread = NULL;
+	self->client->WaitForServerData = NULL;
+}
+
+/* The protocol thread keeps writing to client->encodingStats, so the main
+ * thread gets the copy that was taken after the last update.
+ */
+void vnc_client_get_encoding_stats(struct vnc_client* self,
+		rfbEncodingStats* stats)
+{
+	struct vnc_thread* thread = self->thread;
+	size_t size = sizeof(self->client->encodingStats);
+
+	if (!thread) {
+		memcpy(stats, self->client->encodingStats, size);
+		return;
+	}
+
+	pthread_mutex_lock(&thread->stats_mutex);
+	memcpy(stats, thread->encoding_stats, size);
+	pthread_mutex_unlock(&thread->stats_mutex);
+}
+
+int vnc_client_get_event_fd(const struct vnc_client* self)
+{
+	return self->thread ? self->thread->wake_fd : -1;
+}
+
+static int vnc_thread_handle_event(struct vnc_client* self,
+		struct vnc_thread_event* event)
+{
+	struct vnc_thread* thread = self->thread;
+
+	switch (event->type) {
+	case VNC_THREAD_EVENT_ALLOC_FB:
+		thread->alloc_result = self->alloc_fb(self);
+		atomic_store(&thread->alloc_pending, false);
+		break;
+	case VNC_THREAD_EVENT_UPDATE_FB:
+		self->update_fb(self);
+		atomic_store(&thread->frame_pending, false);
+		break;
+	case VNC_THREAD_EVENT_CUT_TEXT:
+		self->cut_text(self, event->text, event->len);
+		free(event->text);
+		event->text = NULL;
+		break;
+	case VNC_THREAD_EVENT_DISCONNECT:
+		return -1;
+	}
+
+	return 0;
+}
+
+int vnc_client_dispatch(struct vnc_client* self)
+{
+	struct vnc_thread* thread = self->thread;
+	assert(thread);
+
+	uint64_t count;
+	read(thread->wake_fd, &count, sizeof(count));
+
+	int rc = 0;
+	unsigned int head = atomic_load_explicit(&thread->head,
+			memory_order_relaxed);
+
+	while (rc == 0 && head != atomic_load_explicit(&thread->tail,
+				memory_order_acquire)) {
+		struct vnc_thread_event* event =
+			&thread->events[head % VNC_THREAD_QUEUE_SIZE];
+		rc = vnc_thread_handle_event(self, event);
+		atomic_store_explicit(&thread->head, ++head,
+				memory_order_release);
+	}
+
+	uint64_t one = 1;
+	write(thread->ack_fd, &one, sizeof(one));
+
+	return rc;
+}
+
+static int vnc_client_get_n_decode_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return n < VNC_MAX_DECODE_WORKERS ? n : VNC_MAX_DECODE_WORKERS;
+}
+
 struct vnc_client* vnc_client_create(void)
 {
 	vnc_client_init_open_h264();
@@ -240,6 +1173,10 @@ struct vnc_client* vnc_client_create(void)
 	self->client = client;
 	rfbClientSetClientData(client, NULL, self);
 
+	// Decoders fall back to doing everything on one thread without a pool
+	client->workerPool =
+		worker_pool_create(vnc_client_get_n_decode_workers());
+
 	client->MallocFrameBuffer = vnc_client_alloc_fb;
 	client->GotFrameBufferUpdate = vnc_client_update_box;
 	client->FinishedFrameBufferUpdate = vnc_client_finish_update;
@@ -248,6 +1185,7 @@ struct vnc_client* vnc_client_create(void)
 	client->GotXCutText = vnc_client_got_cut_text;
 
 	self->pts = NO_PTS;
+	self->quality_level = client->appData.qualityLevel;
 
 	return self;
 
@@ -258,8 +1196,17 @@ failure:
 
 void vnc_client_destroy(struct vnc_client* self)
 {
+	vnc_client_stop_thread(self);
 	vnc_client_clear_av_frames(self);
+	vnc_client_clear_render_ops(self);
+	free(self->render_ops);
+	vnc_client_destroy_tj_handles(self);
+	quality_controller_destroy(self->quality_controller);
+	pixman_region_fini(&self->stale_fb);
+	pixman_region_fini(&self->update_uploads);
+	free(self->adaptive_encodings);
 	open_h264_destroy(self->open_h264);
+	worker_pool_destroy(self->client->workerPool);
 	rfbClientCleanup(self->client);
 	free(self);
 }
@@ -272,6 +1219,12 @@ int vnc_client_connect(struct vnc_client* self, const char* address, int port)
 	free(client->serverHost);
 	client->serverHost = strdup(address);
 
+	/* The main loop does not watch the socket in threaded mode, so the
+	 * handshake must wait for data on its own.
+	 */
+	if (self->use_thread)
+		client->WaitForServerData = vnc_client_wait_for_server_data;
+
 	return ConnectToRFBServer(client, address, port) ? 0 : -1;
 }
 
@@ -282,7 +1235,59 @@ int vnc_client_init(struct vnc_client* self)
 
 	vnc_client_lock_handler(self);
 
-	if (!InitialiseRFBConnection(client))
+	if (self->decode_jpeg_to_yuv) {
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		client->GotJpeg = vnc_client_got_jpeg;
+#else
+		self->decode_jpeg_to_yuv = false;
+#endif
+	}
+
+	if (vnc_client_uses_render_ops(self)) {
+		self->copy_rect = client->GotCopyRect;
+		client->GotCopyRect = vnc_client_copy_rect;
+	}
+
+	/* Those decoders write 32 bit pixels */
+	if (self->decode_jpeg_to_yuv && self->low_bandwidth_threshold) {
+		fprintf(stderr, "Low bandwidth mode does not work with GPU JPEG decoding\n");
+		self->low_bandwidth_threshold = 0;
+	}
+
+	if (self->adaptive_quality || self->low_bandwidth_threshold) {
+		const char* encodings = client->appData.encodingsString;
+		bool can_use_h264 = vnc_client_has_encoding(encodings,
+				"open-h264") && vnc_client_has_encoding(encodings,
+				"tight");
+		const char* h264 = strcasestr(encodings, "open-h264");
+		const char* tight = strcasestr(encodings, "tight");
+
+		self->prefer_h264 = can_use_h264 && h264 < tight;
+
+		struct quality_settings initial = {
+			.quality = self->quality_level,
+			.prefer_h264 = self->prefer_h264,
+			.bits_per_pixel = client->format.bitsPerPixel,
+		};
+		struct quality_controller_config config = {
+			.adapt_quality = self->adaptive_quality,
+			.can_use_h264 = can_use_h264,
+			.low_bandwidth_threshold =
+				self->low_bandwidth_threshold,
+		};
+
+		self->quality_controller =
+			quality_controller_create(&initial, &config);
+		if (!self->quality_controller)
+			goto failure;
+	}
+
+	/* A replayed session starts where the handshake ended */
+	if (!client->vncRec && !InitialiseRFBConnection(client))
+		goto failure;
+
+	if (self->record_path &&
+			!StartRecordingRFBSession(client, self->record_path))
 		goto failure;
 
 	client->width = client->si.framebufferWidth;
@@ -312,52 +1317,80 @@ int vnc_client_init(struct vnc_client* self)
 	rc = 0;
 failure:
 	vnc_client_unlock_handler(self);
+
+	if (rc == 0 && self->use_thread)
+		rc = vnc_client_start_thread(self);
+
 	return rc;
 }
 
+int vnc_client_open_replay(struct vnc_client* self, const char* path)
+{
+	rfbClient* client = self->client;
+
+	if (!StartReplayingRFBSession(client, path))
+		return -1;
+
+	/* Reduced depths are derived from the 32 bit format on allocation */
+	if (client->format.bitsPerPixel == 32)
+		self->pixel_format = client->format.redShift == 0 ?
+			DRM_FORMAT_XBGR8888 : DRM_FORMAT_XRGB8888;
+	self->fb_pixel_format = vnc_client_drm_format(self, &client->format);
+
+	return 0;
+}
+
+bool vnc_client_is_replay_done(const struct vnc_client* self)
+{
+	return IsRFBSessionReplayDone(self->client);
+}
+
 int vnc_client_set_pixel_format(struct vnc_client* self, uint32_t format)
 {
 	rfbPixelFormat* dst = &self->client->format;
-	int bpp = -1;
 
-	switch (format) {
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_XRGB8888:
-		dst->redShift = 16;
-		dst->greenShift = 8;
-		dst->blueShift = 0;
-		bpp = 32;
-		break;
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_XBGR8888:
-		dst->redShift = 0;
-		dst->greenShift = 8;
-		dst->blueShift = 16;
-		bpp = 32;
-		break;
-	default:
+	if (vnc_client_make_pixel_format(dst, format) < 0)
 		return -1;
-	}
-
-	switch (bpp) {
-	case 32:
-		dst->bitsPerPixel = 32;
-		dst->depth = 24;
-		dst->redMax = 0xff;
-		dst->greenMax = 0xff;
-		dst->blueMax = 0xff;
-		break;
-	default:
-		abort();
-	}
 
-	dst->trueColour = 1;
-	dst->bigEndian = FALSE;
+	self->pixel_format = format;
+	self->fb_pixel_format = format;
 	self->client->appData.requestedDepth = dst->depth;
 
 	return 0;
 }
 
+/* Called from the main thread when copies could not be drawn into the
+ * texture. The framebuffer is stale where they went, so all of it is
+ * requested again, and copies are done on the CPU from the next update on.
+ */
+void vnc_client_disable_gpu_copy_rect(struct vnc_client* self)
+{
+	if (atomic_exchange(&self->gpu_copy_rect_failed, true))
+		return;
+
+	fprintf(stderr, "Failed to copy rectangles on the GPU. Copying on the CPU instead.\n");
+	vnc_client_request_refresh(self);
+}
+
+/* The framebuffer is requested again by the protocol thread, as it owns the
+ * request state.
+ */
+void vnc_client_request_refresh(struct vnc_client* self)
+{
+	if (!self->thread) {
+		vnc_client_send_refresh(self);
+		return;
+	}
+
+	uint64_t one = 1;
+	write(self->thread->refresh_fd, &one, sizeof(one));
+}
+
+uint32_t vnc_client_get_pixel_format(const struct vnc_client* self)
+{
+	return self->fb_pixel_format;
+}
+
 int vnc_client_get_width(const struct vnc_client* self)
 {
 	return self->client->width;
@@ -440,6 +1473,7 @@ void vnc_client_set_encodings(struct vnc_client* self, const char* encodings)
 
 void vnc_client_set_quality_level(struct vnc_client* self, int value)
 {
+	self->quality_level = value;
 	self->client->appData.qualityLevel = value;
 }
 
@@ -448,6 +1482,38 @@ void vnc_client_set_compression_level(struct vnc_client* self, int value)
 	self->client->appData.compressLevel = value;
 }
 
+void vnc_client_set_continuous_updates(struct vnc_client* self, bool enable)
+{
+	self->client->appData.enableContinuousUpdates = enable;
+}
+
+void vnc_client_set_adaptive_quality(struct vnc_client* self, bool enable)
+{
+	self->adaptive_quality = enable;
+}
+
+void vnc_client_set_low_bandwidth_threshold(struct vnc_client* self,
+		uint64_t bytes_per_second)
+{
+	self->low_bandwidth_threshold = bytes_per_second;
+}
+
+void vnc_client_set_update_request_window(struct vnc_client* self, int value)
+{
+	self->client->appData.updateRequestWindow = value;
+}
+
+int vnc_client_set_decode_workers(struct vnc_client* self, int value)
+{
+	struct worker_pool* pool = worker_pool_create(value);
+	if (!pool)
+		return -1;
+
+	worker_pool_destroy(self->client->workerPool);
+	self->client->workerPool = pool;
+	return 0;
+}
+
 void vnc_client_send_cut_text(struct vnc_client* self, const char* text,
 		size_t len)
 {
@@ -26,8 +26,12 @@
 #include <string.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <pixman.h>
 #include "rfbclient.h"
 #include "tls.h"
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+#include "turbojpeg.h"
+#endif
 
 extern const char* tls_cert_path;
 extern const char* auth_command;
@@ -256,8 +260,34 @@ static rfbBool CheckRect(rfbClient* client, int x, int y, int w, int h) {
   return x + w <= client->width && y + h <= client->height;
 }
 
+/*
+ * Rows are filled or copied as a whole, so that the work is done by pixman
+ * and the C library, which pick SIMD implementations for the CPU at run time.
+ */
+
+static void FillRow(uint8_t* row, int bpp, int w, uint32_t colour) {
+  int i;
+
+  switch (bpp) {
+  case 8:
+    memset(row, colour, w);
+    break;
+  case 16:
+    for (i = 0; i < w; i++)
+      ((uint16_t*)row)[i] = colour;
+    break;
+  case 32:
+    for (i = 0; i < w; i++)
+      ((uint32_t*)row)[i] = colour;
+    break;
+  }
+}
+
 static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
-  int i,j;
+  int bpp = client->format.bitsPerPixel;
+  int stride = client->width * bpp / 8;
+  uint8_t* first;
+  int j;
 
   if (client->frameBuffer == NULL) {
       return;
@@ -268,18 +298,25 @@ static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_
     return;
   }
 
-#define FILL_RECT(BPP) \
-    for(j=y*client->width;j<(y+h)*client->width;j+=client->width) \
-      for(i=x;i<x+w;i++) \
-	((uint##BPP##_t*)client->frameBuffer)[j+i]=colour;
-
-  switch(client->format.bitsPerPixel) {
-  case  8: FILL_RECT(8);  break;
-  case 16: FILL_RECT(16); break;
-  case 32: FILL_RECT(32); break;
-  default:
-    rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+  if (bpp != 8 && bpp != 16 && bpp != 32) {
+    rfbClientLog("Unsupported bitsPerPixel: %d\n", bpp);
+    return;
   }
+
+  if (w <= 0 || h <= 0)
+    return;
+
+  /* pixman wants the stride in 32 bit words */
+  if (stride % 4 == 0 &&
+      pixman_fill((uint32_t*)client->frameBuffer, stride / 4, bpp, x, y, w, h,
+                  colour))
+    return;
+
+  first = client->frameBuffer + y * stride + x * bpp / 8;
+  FillRow(first, bpp, w, colour);
+
+  for (j = 1; j < h; j++)
+    memcpy(first + j * stride, first, w * bpp / 8);
 }
 
 static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
@@ -312,9 +349,13 @@ static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y
   }
 }
 
-/* TODO: test */
 static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
-  int i,j;
+  int bpp = client->format.bitsPerPixel;
+  int stride = client->width * bpp / 8;
+  int row_size = w * bpp / 8;
+  uint8_t* src;
+  uint8_t* dst;
+  int j;
 
   if (client->frameBuffer == NULL) {
       return;
@@ -330,42 +371,37 @@ static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y,
     return;
   }
 
-#define COPY_RECT_FROM_RECT(BPP) \
-  { \
-    uint##BPP##_t* _buffer=((uint##BPP##_t*)client->frameBuffer)+(src_y-dest_y)*client->width+src_x-dest_x; \
-    if (dest_y < src_y) { \
-      for(j = dest_y*client->width; j < (dest_y+h)*client->width; j += client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
-    } else { \
-      for(j = (dest_y+h-1)*client->width; j >= dest_y*client->width; j-=client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
-    } \
+  if (bpp != 8 && bpp != 16 && bpp != 32) {
+    rfbClientLog("Unsupported bitsPerPixel: %d\n", bpp);
+    return;
   }
 
-  switch(client->format.bitsPerPixel) {
-  case  8: COPY_RECT_FROM_RECT(8);  break;
-  case 16: COPY_RECT_FROM_RECT(16); break;
-  case 32: COPY_RECT_FROM_RECT(32); break;
-  default:
-    rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+  if (w <= 0 || h <= 0)
+    return;
+
+  src = client->frameBuffer + src_y * stride + src_x * bpp / 8;
+  dst = client->frameBuffer + dest_y * stride + dest_x * bpp / 8;
+
+  /* Full width rows are contiguous, which is common when scrolling */
+  if (row_size == stride) {
+    memmove(dst, src, (size_t)h * stride);
+    return;
+  }
+
+  if (src_y + h <= dest_y || dest_y + h <= src_y) {
+    for (j = 0; j < h; j++)
+      memcpy(dst + j * stride, src + j * stride, row_size);
+    return;
+  }
+
+  /* When scrolling, each row must be read before it is overwritten. Rows
+   * that overlap within themselves are left to memmove. */
+  if (dest_y <= src_y) {
+    for (j = 0; j < h; j++)
+      memmove(dst + j * stride, src + j * stride, row_size);
+  } else {
+    for (j = h - 1; j >= 0; j--)
+      memmove(dst + j * stride, src + j * stride, row_size);
   }
 }
 
@@ -386,6 +422,8 @@ static void initAppData(AppData* data) {
 	data->enableJPEG=FALSE;
 #endif
 	data->useRemoteCursor=FALSE;
+	data->enableContinuousUpdates=TRUE;
+	data->updateRequestWindow=1;
 }
 
 rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
@@ -450,6 +488,8 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->bufoutptr=client->buf;
   client->buffered=0;
 
+  INIT_MUTEX(client->writeMutex);
+
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   client->raw_buffer_size = -1;
   client->decompStreamInited = FALSE;
@@ -517,6 +557,18 @@ void rfbClientCleanup(rfbClient* client) {
 	client->decompStream.msg != NULL)
       rfbClientLog("inflateEnd: %s\n", client->decompStream.msg );
   }
+
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+  if (client->tjhnd)
+    tjDestroy(client->tjhnd);
+
+  for ( i = 0; i < client->workerTjhndsCount; i++ )
+    if (client->workerTjhnds[i])
+      tjDestroy(client->workerTjhnds[i]);
+
+  free(client->workerTjhnds);
+  FreePendingJpegRects(client);
+#endif
 #endif
 
   if (client->ultra_buffer)
@@ -533,7 +585,11 @@ void rfbClientCleanup(rfbClient* client) {
     client->clientData = next;
   }
 
-  free(client->vncRec);
+  if (client->vncRec) {
+    if (client->vncRec->file)
+      fclose(client->vncRec->file);
+    free(client->vncRec);
+  }
 
   if (client->sock != RFB_INVALID_SOCKET)
     rfbCloseSocket(client->sock);
@@ -551,5 +607,7 @@ void rfbClientCleanup(rfbClient* client) {
     free(client->saslSecret);
 #endif /* LIBVNCSERVER_HAVE_SASL */
 
+  TINI_MUTEX(client->writeMutex);
+
   free(client);
 }
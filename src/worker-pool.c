@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "worker-pool.h"
+
+struct worker {
+	struct worker_pool* pool;
+	pthread_t thread;
+	int index;
+};
+
+struct worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+
+	uint64_t generation;
+	bool stop;
+	int n_busy;
+
+	worker_pool_fn fn;
+	void* userdata;
+	int n_jobs;
+	atomic_int next_job;
+
+	int n_threads;
+	struct worker threads[];
+};
+
+static void worker_pool_do_jobs(struct worker_pool* self, worker_pool_fn fn,
+		void* userdata, int n_jobs, int worker)
+{
+	for (;;) {
+		int job = atomic_fetch_add(&self->next_job, 1);
+		if (job >= n_jobs)
+			break;
+
+		fn(userdata, job, worker);
+	}
+}
+
+static void* worker_pool_thread(void* userdata)
+{
+	struct worker* worker = userdata;
+	struct worker_pool* self = worker->pool;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&self->mutex);
+	for (;;) {
+		while (!self->stop && self->generation == generation)
+			pthread_cond_wait(&self->start_cond, &self->mutex);
+
+		if (self->stop)
+			break;
+
+		generation = self->generation;
+		worker_pool_fn fn = self->fn;
+		void* fn_userdata = self->userdata;
+		int n_jobs = self->n_jobs;
+		pthread_mutex_unlock(&self->mutex);
+
+		worker_pool_do_jobs(self, fn, fn_userdata, n_jobs,
+				worker->index);
+
+		pthread_mutex_lock(&self->mutex);
+		if (--self->n_busy == 0)
+			pthread_cond_signal(&self->done_cond);
+	}
+	pthread_mutex_unlock(&self->mutex);
+
+	return NULL;
+}
+
+static void worker_pool_stop(struct worker_pool* self, int n_started)
+{
+	pthread_mutex_lock(&self->mutex);
+	self->stop = true;
+	pthread_cond_broadcast(&self->start_cond);
+	pthread_mutex_unlock(&self->mutex);
+
+	for (int i = 0; i < n_started; ++i)
+		pthread_join(self->threads[i].thread, NULL);
+}
+
+struct worker_pool* worker_pool_create(int n_workers)
+{
+	int n_threads = n_workers > 1 ? n_workers - 1 : 0;
+
+	struct worker_pool* self = calloc(1, sizeof(*self) +
+			n_threads * sizeof(self->threads[0]));
+	if (!self)
+		return NULL;
+
+	pthread_mutex_init(&self->mutex, NULL);
+	pthread_cond_init(&self->start_cond, NULL);
+	pthread_cond_init(&self->done_cond, NULL);
+
+	for (int i = 0; i < n_threads; ++i) {
+		struct worker* worker = &self->threads[i];
+		worker->pool = self;
+		worker->index = i + 1;
+
+		if (pthread_create(&worker->thread, NULL, worker_pool_thread,
+					worker) != 0)
+			goto failure;
+
+		self->n_threads++;
+	}
+
+	return self;
+
+failure:
+	worker_pool_stop(self, self->n_threads);
+	pthread_cond_destroy(&self->done_cond);
+	pthread_cond_destroy(&self->start_cond);
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+	return NULL;
+}
+
+void worker_pool_destroy(struct worker_pool* self)
+{
+	if (!self)
+		return;
+
+	worker_pool_stop(self, self->n_threads);
+	pthread_cond_destroy(&self->done_cond);
+	pthread_cond_destroy(&self->start_cond);
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+}
+
+int worker_pool_get_n_workers(const struct worker_pool* self)
+{
+	return self->n_threads + 1;
+}
+
+void worker_pool_run(struct worker_pool* self, worker_pool_fn fn,
+		void* userdata, int n_jobs)
+{
+	if (self->n_threads == 0 || n_jobs <= 1) {
+		for (int i = 0; i < n_jobs; ++i)
+			fn(userdata, i, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&self->mutex);
+	self->fn = fn;
+	self->userdata = userdata;
+	self->n_jobs = n_jobs;
+	atomic_store(&self->next_job, 0);
+	self->n_busy = self->n_threads;
+	self->generation++;
+	pthread_cond_broadcast(&self->start_cond);
+	pthread_mutex_unlock(&self->mutex);
+
+	worker_pool_do_jobs(self, fn, userdata, n_jobs, 0);
+
+	pthread_mutex_lock(&self->mutex);
+	while (self->n_busy > 0)
+		pthread_cond_wait(&self->done_cond, &self->mutex);
+	pthread_mutex_unlock(&self->mutex);
+}